@@ -0,0 +1,153 @@
+//
+// Load-time control flow analysis of the bytecode
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "analysis.h"
+#include "runtime.h"
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static int index_of(const program *p, const int offset) {
+  if (offset < 0 || offset >= p->bf->code_size || p->index[offset] < 0) {
+    failure("*** FAILURE: control transfer to 0x%.8x is not an instruction boundary\n", offset);
+  }
+  return p->index[offset];
+}
+
+int instruction_successors(const program *p, const int insn, int succ[2]) {
+  const instruction *i = &p->insns[insn];
+  int n = 0;
+  if (i->h == CONST && i->l == JMP) {
+    succ[n++] = index_of(p, i->args[0]);
+    return n;
+  }
+  if (i->h == CONTROL && (i->l == CJMPz || i->l == CJMPnz)) {
+    succ[n++] = index_of(p, i->args[0]);
+  }
+  if (!instruction_is_terminal(i)) {
+    succ[n++] = insn + 1;
+  }
+  return n;
+}
+
+/* Collects the function starting at the BEGIN with a depth-first walk over its control flow graph */
+static void discover_function(program *p, const int begin, int *stack) {
+  const instruction *b = &p->insns[begin];
+  if (b->h != CONTROL || (b->l != BEGIN && b->l != CBEGIN)) {
+    failure("*** FAILURE: function at 0x%.8x does not start with BEGIN\n", b->offset);
+  }
+  const int id = p->functions_num++;
+  function *f = &p->functions[id];
+  f->begin = b->offset;
+  f->args_num = b->args[0];
+  f->locals_num = b->args[1];
+  f->insns_num = 0;
+
+  f->max_depth = 0;
+
+  // lamac keeps the operand stack depth equal on all paths to an instruction, the walk checks it
+  int top = 0;
+  stack[top++] = begin;
+  p->owner[begin] = id;
+  p->depth[begin] = 0;
+  while (top > 0) {
+    const int insn = stack[--top];
+    const instruction *i = &p->insns[insn];
+    f->insns_num++;
+    int pops, pushes;
+    instruction_stack_effect(i, &pops, &pushes);
+    const int depth = p->depth[insn];
+    if (depth < pops && !(i->h == CONST && (i->l == END || i->l == RET))) {
+      failure("*** FAILURE: operand stack underflow at 0x%.8x\n", i->offset);
+    }
+    const int next_depth = depth - pops + pushes;
+    if (next_depth > f->max_depth) f->max_depth = next_depth;
+
+    int succ[2];
+    const int n = instruction_successors(p, insn, succ);
+    for (int k = 0; k < n; k++) {
+      if (p->owner[succ[k]] < 0) {
+        p->owner[succ[k]] = id;
+        p->depth[succ[k]] = next_depth;
+        stack[top++] = succ[k];
+      } else if (p->owner[succ[k]] == id && p->depth[succ[k]] != next_depth) {
+        failure("*** FAILURE: operand stack depth mismatch at 0x%.8x\n", p->insns[succ[k]].offset);
+      }
+    }
+  }
+
+  f->insns = checked_calloc(f->insns_num, sizeof(int));
+  for (int i = 0, k = 0; k < f->insns_num; i++) {
+    if (p->owner[i] == id) f->insns[k++] = i;
+  }
+}
+
+program *analyze_program(const bytefile *bf) {
+  program *p = checked_calloc(1, sizeof(program));
+  p->bf = bf;
+  // Every instruction takes at least one byte
+  p->insns = checked_calloc(bf->code_size, sizeof(instruction));
+  p->index = checked_calloc(bf->code_size, sizeof(int));
+  memset(p->index, -1, bf->code_size * sizeof(int));
+
+  unsigned int offset = 0;
+  do {
+    if (offset >= bf->code_size) {
+      failure("*** FAILURE: code section is not terminated\n");
+    }
+    p->index[offset] = p->insns_num;
+    decode_instruction(bf, offset, &p->insns[p->insns_num]);
+    offset = p->insns[p->insns_num++].next;
+  } while (p->insns[p->insns_num - 1].h != STOP);
+
+  p->owner = checked_calloc(p->insns_num, sizeof(int));
+  memset(p->owner, -1, p->insns_num * sizeof(int));
+  p->depth = checked_calloc(p->insns_num, sizeof(int));
+  memset(p->depth, -1, p->insns_num * sizeof(int));
+  p->functions = checked_calloc(p->insns_num, sizeof(function));
+  int *stack = checked_calloc(p->insns_num, sizeof(int));
+
+  // Public symbols are entries, the other functions are discovered through CALL and CLOSURE instructions
+  const int main = index_of(p, bf->entrypoint_offset);
+  discover_function(p, main, stack);
+  for (unsigned int i = 0; i < bf->public_symbols_number; i++) {
+    const int offset = get_public_offset(bf, i);
+    if (offset >= 0 && offset < bf->code_size && p->index[offset] >= 0 && p->owner[p->index[offset]] < 0) {
+      discover_function(p, p->index[offset], stack);
+    }
+  }
+  for (int f = 0; f < p->functions_num; f++) {
+    for (int k = 0; k < p->functions[f].insns_num; k++) {
+      const instruction *i = &p->insns[p->functions[f].insns[k]];
+      if (i->h == CONTROL && (i->l == CALL || i->l == MAKE_CLOSURE)) {
+        const int entry = index_of(p, i->args[0]);
+        if (p->owner[entry] < 0) {
+          discover_function(p, entry, stack);
+        }
+      }
+    }
+  }
+  free(stack);
+  return p;
+}
+
+void free_program(program *p) {
+  for (int f = 0; f < p->functions_num; f++) {
+    free(p->functions[f].insns);
+  }
+  free(p->functions);
+  free(p->owner);
+  free(p->depth);
+  free(p->index);
+  free(p->insns);
+  free(p);
+}
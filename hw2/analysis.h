@@ -0,0 +1,39 @@
+//
+// Load-time control flow analysis of the bytecode: decoded instructions,
+// functions reachable from public symbols and their intraprocedural control flow graphs
+//
+
+#ifndef HW2_ANALYSIS_H
+#define HW2_ANALYSIS_H
+
+#include "bytecode.h"
+
+typedef struct {
+  unsigned int begin;           // Offset of the BEGIN/CBEGIN instruction
+  int args_num;
+  int locals_num;
+  int max_depth;                // Maximal operand stack depth
+  int *insns;                   // Indices of the instructions reachable from BEGIN, in code order
+  int insns_num;
+} function;
+
+typedef struct {
+  const bytefile *bf;
+  instruction *insns;           // All instructions of the code section in code order, the last one is STOP
+  int insns_num;
+  int *index;                   // Code offset -> index of the instruction starting there, -1 inside instructions
+  int *owner;                   // Instruction index -> index of the function it belongs to, -1 if unreachable
+  int *depth;                   // Instruction index -> operand stack depth before it, -1 if unreachable
+  function *functions;
+  int functions_num;
+} program;
+
+/* Decodes the code section and discovers the functions reachable from public symbols through CALL and CLOSURE */
+program *analyze_program(const bytefile *bf);
+
+void free_program(program *p);
+
+/* Stores indices of the intraprocedural successors of the instruction and returns their number (at most 2) */
+int instruction_successors(const program *p, int insn, int succ[2]);
+
+#endif //HW2_ANALYSIS_H
@@ -0,0 +1,319 @@
+/* Benchmark runner for the Lama SM bytecode interpreter */
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define MAX_BENCHMARKS 64
+#define MAX_REPEATS 100
+#define NAME_SIZE 64
+
+typedef struct {
+  char name[NAME_SIZE];
+  char bytecode[PATH_MAX];
+  char input[PATH_MAX];
+  int repeats;
+} benchmark;
+
+typedef struct {
+  char name[NAME_SIZE];
+  int runs;
+  double wall_median;           // seconds
+  double wall_mad;              // median absolute deviation, seconds
+  unsigned long long instructions;
+  double ips;                   // instructions per second at the median wall time
+  unsigned long gc_count;
+  long peak_rss_kb;
+} result;
+
+typedef struct {
+  double wall;
+  unsigned long long instructions;
+  unsigned long gc_count;
+  long peak_rss_kb;
+} run;
+
+static void die(const char *fmt, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+static void die(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "bench: ");
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  exit(2);
+}
+
+/* Resolves a path from the suite file relative to the suite's directory */
+static void resolve(char *out, const char *dir, const char *path) {
+  const int length = path[0] == '/' ? snprintf(out, PATH_MAX, "%s", path)
+                                    : snprintf(out, PATH_MAX, "%s/%s", dir, path);
+  if (length < 0 || length >= PATH_MAX) {
+    die("path too long: %s/%s\n", dir, path);
+  }
+}
+
+/* Reads "name bytecode input repeats" lines, '#' starts a comment */
+static int read_suite(const char *fname, benchmark *bs) {
+  FILE *f = fopen(fname, "r");
+  if (f == NULL) {
+    die("cannot open suite %s: %s\n", fname, strerror(errno));
+  }
+  char copy[PATH_MAX];
+  snprintf(copy, sizeof(copy), "%s", fname);
+  const char *dir = dirname(copy);
+
+  char line[3 * PATH_MAX];
+  int n = 0, line_number = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line_number++;
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+    char name[NAME_SIZE], bc[PATH_MAX], input[PATH_MAX];
+    int repeats;
+    const int fields = sscanf(line, "%63s %4095s %4095s %d", name, bc, input, &repeats);
+    if (fields <= 0) continue;
+    if (fields != 4) {
+      die("%s:%d: malformed suite line: %s", fname, line_number, line);
+    }
+    if (repeats < 1) {
+      die("%s:%d: the repeat count of %s must be positive\n", fname, line_number, name);
+    }
+    if (n == MAX_BENCHMARKS) {
+      die("too many benchmarks in %s\n", fname);
+    }
+    snprintf(bs[n].name, NAME_SIZE, "%s", name);
+    resolve(bs[n].bytecode, dir, bc);
+    resolve(bs[n].input, dir, input);
+    bs[n].repeats = repeats;
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Runs the interpreter once with stdout discarded and collects its --stats output */
+static run run_once(const char *interpreter, const benchmark *b) {
+  char stats[] = "/tmp/hw2-bench-XXXXXX";
+  const int stats_fd = mkstemp(stats);
+  if (stats_fd < 0) {
+    die("mkstemp: %s\n", strerror(errno));
+  }
+  close(stats_fd);
+
+  const double start = now();
+  const pid_t pid = fork();
+  if (pid < 0) {
+    die("fork: %s\n", strerror(errno));
+  }
+  if (pid == 0) {
+    const int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+      dup2(null_fd, STDOUT_FILENO);
+    }
+    // A fixed seed makes every run of a benchmark execute the same path
+    execl(interpreter, interpreter, "--stats", stats, "--seed", "1", b->bytecode, b->input, (char *) NULL);
+    fprintf(stderr, "bench: exec %s: %s\n", interpreter, strerror(errno));
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    die("wait4: %s\n", strerror(errno));
+  }
+  run r = {.wall = now() - start, .peak_rss_kb = usage.ru_maxrss};
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    unlink(stats);
+    die("%s failed with status %d\n", b->name, status);
+  }
+
+  FILE *f = fopen(stats, "r");
+  if (f == NULL) {
+    die("%s did not write stats\n", b->name);
+  }
+  char key[64];
+  unsigned long long value;
+  while (fscanf(f, "%63s %llu", key, &value) == 2) {
+    if (strcmp(key, "instructions") == 0) r.instructions = value;
+    else if (strcmp(key, "gc_count") == 0) r.gc_count = value;
+  }
+  fclose(f);
+  unlink(stats);
+  return r;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double median(double *values, const int n) {
+  qsort(values, n, sizeof(double), compare_doubles);
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static result measure(const char *interpreter, const benchmark *b, const int repeats) {
+  double walls[MAX_REPEATS], deviations[MAX_REPEATS];
+  run runs[MAX_REPEATS];
+  // read_suite and --repeat make sure there is at least one run
+  int n = 0;
+  do {
+    runs[n] = run_once(interpreter, b);
+    walls[n] = runs[n].wall;
+  } while (++n < repeats);
+
+  result r = {.runs = repeats};
+  snprintf(r.name, NAME_SIZE, "%s", b->name);
+  r.wall_median = median(walls, repeats);
+  for (int i = 0; i < repeats; i++) {
+    deviations[i] = runs[i].wall > r.wall_median ? runs[i].wall - r.wall_median : r.wall_median - runs[i].wall;
+  }
+  r.wall_mad = median(deviations, repeats);
+  // Instruction and GC counts are deterministic for a fixed input, RSS is reported as the worst run
+  r.instructions = runs[0].instructions;
+  r.gc_count = runs[0].gc_count;
+  for (int i = 0; i < repeats; i++) {
+    if (runs[i].peak_rss_kb > r.peak_rss_kb) r.peak_rss_kb = runs[i].peak_rss_kb;
+  }
+  r.ips = r.wall_median > 0 ? r.instructions / r.wall_median : 0;
+  return r;
+}
+
+/* Every benchmark is written on its own line so that read_results can parse it back with sscanf */
+static void write_results(const char *fname, const result *rs, const int n) {
+  FILE *f = fopen(fname, "w");
+  if (f == NULL) {
+    die("cannot write %s: %s\n", fname, strerror(errno));
+  }
+  fprintf(f, "{\n  \"benchmarks\": [\n");
+  for (int i = 0; i < n; i++) {
+    fprintf(f, "    {\"name\": \"%s\", \"runs\": %d, \"wall_median_s\": %.6f, \"wall_mad_s\": %.6f, "
+               "\"instructions\": %llu, \"ips\": %.0f, \"gc_count\": %lu, \"peak_rss_kb\": %ld}%s\n",
+            rs[i].name, rs[i].runs, rs[i].wall_median, rs[i].wall_mad, rs[i].instructions, rs[i].ips,
+            rs[i].gc_count, rs[i].peak_rss_kb, i + 1 < n ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+static int read_results(const char *fname, result *rs) {
+  FILE *f = fopen(fname, "r");
+  if (f == NULL) {
+    die("cannot open baseline %s: %s\n", fname, strerror(errno));
+  }
+  char line[1024];
+  int n = 0;
+  while (fgets(line, sizeof(line), f) != NULL && n < MAX_BENCHMARKS) {
+    result *r = &rs[n];
+    if (sscanf(line,
+               " {\"name\": \"%63[^\"]\", \"runs\": %d, \"wall_median_s\": %lf, \"wall_mad_s\": %lf, "
+               "\"instructions\": %llu, \"ips\": %lf, \"gc_count\": %lu, \"peak_rss_kb\": %ld",
+               r->name, &r->runs, &r->wall_median, &r->wall_mad, &r->instructions, &r->ips,
+               &r->gc_count, &r->peak_rss_kb) == 8) {
+      n++;
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+static const result *find(const result *rs, const int n, const char *name) {
+  for (int i = 0; i < n; i++) {
+    if (strcmp(rs[i].name, name) == 0) return &rs[i];
+  }
+  return NULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s --interpreter PATH --suite FILE [--output FILE] [--baseline FILE]\n"
+          "          [--threshold PERCENT] [--repeat N] [--filter NAME]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  static const struct option options[] = {
+    {"interpreter", required_argument, NULL, 'i'},
+    {"suite", required_argument, NULL, 's'},
+    {"output", required_argument, NULL, 'o'},
+    {"baseline", required_argument, NULL, 'b'},
+    {"threshold", required_argument, NULL, 't'},
+    {"repeat", required_argument, NULL, 'r'},
+    {"filter", required_argument, NULL, 'f'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *interpreter = NULL, *suite = NULL, *output = "bench.json", *baseline = NULL, *filter = NULL;
+  double threshold = 10;
+  int repeat = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+      case 'i': interpreter = optarg; break;
+      case 's': suite = optarg; break;
+      case 'o': output = optarg; break;
+      case 'b': baseline = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      case 'r': repeat = atoi(optarg); break;
+      case 'f': filter = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (interpreter == NULL || suite == NULL || repeat < 0 || repeat > MAX_REPEATS) {
+    usage(argv[0]);
+  }
+
+  static benchmark bs[MAX_BENCHMARKS];
+  static result rs[MAX_BENCHMARKS], base[MAX_BENCHMARKS];
+  const int n = read_suite(suite, bs);
+  const int base_n = baseline != NULL ? read_results(baseline, base) : 0;
+
+  printf("%-12s %5s %12s %10s %14s %10s %8s %12s\n",
+         "benchmark", "runs", "median, s", "mad, s", "instructions", "Minsn/s", "gcs", "rss, KiB");
+  int measured = 0, regressions = 0;
+  for (int i = 0; i < n; i++) {
+    if (filter != NULL && strcmp(filter, bs[i].name) != 0) continue;
+    int repeats = repeat > 0 ? repeat : bs[i].repeats;
+    if (repeats > MAX_REPEATS) repeats = MAX_REPEATS;
+    const result r = rs[measured++] = measure(interpreter, &bs[i], repeats);
+    printf("%-12s %5d %12.4f %10.4f %14llu %10.1f %8lu %12ld",
+           r.name, r.runs, r.wall_median, r.wall_mad, r.instructions, r.ips / 1e6, r.gc_count, r.peak_rss_kb);
+
+    const result *b = find(base, base_n, r.name);
+    if (b != NULL && b->wall_median > 0) {
+      const double change = (r.wall_median - b->wall_median) / b->wall_median * 100;
+      const int regressed = change > threshold;
+      regressions += regressed;
+      printf("  %+6.1f%%%s", change, regressed ? "  REGRESSION" : "");
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+  write_results(output, rs, measured);
+  printf("Results written to %s\n", output);
+  if (regressions > 0) {
+    printf("%d benchmark(s) regressed by more than %.1f%% against %s\n", regressions, threshold, baseline);
+    return 1;
+  }
+  return 0;
+}
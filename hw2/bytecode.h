@@ -0,0 +1,109 @@
+//
+// Opcodes of the Lama stack machine and a decoder for single instructions
+//
+
+#ifndef HW2_BYTECODE_H
+#define HW2_BYTECODE_H
+
+#include <stdio.h>
+
+#include "interpreter.h"
+
+enum Instruction {
+  // High nibble values (h)
+  BINOP = 0,
+  CONST = 1,
+  LD = 2,
+  LDA = 3,
+  ST = 4,
+  CONTROL = 5,
+  PATT = 6,
+  BUILTIN = 7,
+  STOP = 15,
+
+  // Low nibble values for CONST group (h=1)
+  CONST_INT = 0,
+  CONST_STRING = 1,
+  MAKE_SEXP = 2,
+  STI = 3,
+  STA = 4,
+  JMP = 5,
+  END = 6,
+  RET = 7,
+  DROP = 8,
+  DUP = 9,
+  SWAP = 10,
+  ELEM = 11,
+
+  // Low nibble values for LD/LDA/ST variable locations
+  GLOBAL = 0,
+  LOCAL = 1,
+  ARG = 2,
+  CLOSURE_VAR = 3,
+
+  // Low nibble values for CONTROL group (h=5)
+  CJMPz = 0,
+  CJMPnz = 1,
+  BEGIN = 2,
+  CBEGIN = 3,
+  MAKE_CLOSURE = 4,
+  CALLC = 5,
+  CALL = 6,
+  TAG = 7,
+  MAKE_ARRAY = 8,
+  FAIL_I = 9,
+  LINE = 10,
+
+  // Low nibble values for PATT group (h=6)
+  PATT_STR_EQ = 0,
+  PATT_STRING = 1,
+  PATT_ARRAY = 2,
+  PATT_SEXP = 3,
+  PATT_BOXED = 4,
+  PATT_UNBOXED = 5,
+  PATT_CLOSURE = 6,
+
+  // Low nibble values for BUILTIN group (h=7)
+  BUILTIN_Lread = 0,
+  BUILTIN_Lwrite = 1,
+  BUILTIN_Llength = 2,
+  BUILTIN_Lstring = 3,
+  BUILTIN_Barray = 4
+};
+
+// A decoded instruction. Immediate operands are stored in the order they
+// appear in the code: the jump/call target or string offset comes first
+typedef struct {
+  unsigned int offset;          // Offset of the opcode byte
+  unsigned int next;            // Offset of the following instruction
+  unsigned char h, l;           // Opcode nibbles
+  int args[2];                  // Immediate operands
+  int args_num;                 // Number of immediate operands used
+  const char *captures;         // CLOSURE: args[1] encoded (designation byte, int index) pairs
+} instruction;
+
+/* Decodes the instruction at the offset, fails on invalid opcodes and truncated operands */
+void decode_instruction(const bytefile *bf, unsigned int offset, instruction *insn);
+
+/* Encodes the instruction into the buffer and returns its size, the inverse of decode_instruction */
+unsigned int encode_instruction(const instruction *insn, char *out);
+
+/* Returns the encoded size of the instruction */
+unsigned int instruction_size(const instruction *insn);
+
+/* Reads the i-th captured variable of a decoded CLOSURE */
+void closure_capture(const instruction *insn, int i, unsigned char *designation, int *index);
+
+/* Returns the code offset the instruction may transfer control to or -1: jump, call and closure targets */
+int instruction_target(const instruction *insn);
+
+/* Stores the number of operand stack values the instruction pops and pushes */
+void instruction_stack_effect(const instruction *insn, int *pops, int *pushes);
+
+/* Returns true if the execution never falls through to the next instruction */
+int instruction_is_terminal(const instruction *insn);
+
+/* Prints the instruction in the dump_file syntax, without the offset and the trailing newline */
+void print_instruction(FILE *f, const bytefile *bf, const instruction *insn);
+
+#endif //HW2_BYTECODE_H
@@ -5,6 +5,7 @@
 #include <stdio.h>
 
 #include "interpreter.h"
+#include "bytecode.h"
 #include "runtime.h"
 
 /* Gets a string from a string table by an index */
@@ -31,6 +32,32 @@ int get_public_offset(const bytefile *f, const unsigned int i) {
   return f->public_ptr[i * 2 + 1];
 }
 
+/* Reads "offset count" lines written by `hw2 --profile` */
+unsigned long long *read_profile(const char *fname, const bytefile *bf) {
+  FILE *f = fopen(fname, "r");
+  if (f == NULL) {
+    failure("cannot open profile %s: %s\n", fname, strerror(errno));
+  }
+  unsigned long long *counts = calloc(bf->code_size, sizeof(unsigned long long));
+  if (counts == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  unsigned long offset;
+  unsigned long long count;
+  int fields;
+  while ((fields = fscanf(f, "%lx %llu", &offset, &count)) == 2) {
+    if (offset >= bf->code_size) {
+      failure("profile %s does not match the bytecode: offset 0x%.8lx is outside of the code\n", fname, offset);
+    }
+    counts[offset] = count;
+  }
+  if (fields != EOF) {
+    failure("profile %s is malformed\n", fname);
+  }
+  fclose(f);
+  return counts;
+}
+
 /* Reads a binary bytecode file by name and unpacks it */
 const bytefile *read_file(const char * fname) {
   FILE *f = fopen(fname, "rb");
@@ -92,254 +119,305 @@ const bytefile *read_file(const char * fname) {
   return file;
 }
 
-static void disassemble(FILE *f, const bytefile *bf);
-
-void dump_file(FILE *f, const bytefile *bf)
-{
-  int i;
-
-  fprintf(f, "String table size       : %d\n", bf->stringtab_size);
-  fprintf(f, "Global area size        : %d\n", bf->global_area_size);
-  fprintf(f, "Number of public symbols: %d\n", bf->public_symbols_number);
-  fprintf(f, "Public symbols          :\n");
-
-  for (i = 0; i < bf->public_symbols_number; i++)
-    fprintf(f, "   0x%.8x: %s\n", get_public_offset(bf, i), get_public_name(bf, i));
-
-  fprintf(f, "Code:\n");
-  disassemble(f, bf);
-}
-
-static void disassemble(FILE *f, const bytefile *bf)
+/* Decodes the instruction at the offset, fails on invalid opcodes and truncated operands */
+void decode_instruction(const bytefile *bf, const unsigned int offset, instruction *insn)
 {
-
-#define INT (ip += sizeof(int), *(int *)(ip - sizeof(int)))
-#define BYTE *ip++
-#define STRING get_string(bf, INT)
-#define FAIL failure("ERROR: invalid opcode %d-%d\n", h, l)
-
-  char *ip = bf->code_ptr;
-  char *ops[] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
-  char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
-  char *lds[] = {"LD", "LDA", "ST"};
-  do
+#define CHECK(n) (ip + (n) > end ? failure("*** FAILURE: truncated instruction at 0x%.8x\n", offset) : (void) 0)
+#define INT (CHECK(sizeof(int)), ip += sizeof(int), *(int *)(ip - sizeof(int)))
+#define FAIL failure("ERROR: invalid opcode %d-%d at 0x%.8x\n", insn->h, insn->l, offset)
+
+  const char *ip = bf->code_ptr + offset;
+  const char *end = bf->code_ptr + bf->code_size;
+  CHECK(1);
+  const unsigned char x = *ip++;
+  insn->offset = offset;
+  insn->h = (x & 0xF0) >> 4;
+  insn->l = x & 0x0F;
+  insn->args_num = 0;
+  insn->captures = NULL;
+
+  switch (insn->h)
   {
-    char x = BYTE,
-         h = (x & 0xF0) >> 4,
-         l = x & 0x0F;
-
-    fprintf(f, "0x%.8x:\t", ip - bf->code_ptr - 1);
+  case STOP:
+  case BINOP:
+    break;
 
-    switch (h)
+  case CONST:
+    switch (insn->l)
     {
-    case 15:
-      goto stop;
-
-    /* BINOP */
-    case 0:
-      fprintf(f, "BINOP\t%s", ops[l - 1]);
+    case CONST_INT:
+    case CONST_STRING:
+    case JMP:
+      insn->args[insn->args_num++] = INT;
+      break;
+    case MAKE_SEXP:
+      insn->args[insn->args_num++] = INT;
+      insn->args[insn->args_num++] = INT;
       break;
+    case STI: case STA: case END: case RET: case DROP: case DUP: case SWAP: case ELEM:
+      break;
+    default:
+      FAIL;
+    }
+    break;
+
+  case LD:
+  case LDA:
+  case ST:
+    if (insn->l > CLOSURE_VAR) FAIL;
+    insn->args[insn->args_num++] = INT;
+    break;
 
-    case 1:
-      switch (l)
+  case CONTROL:
+    switch (insn->l)
+    {
+    case CJMPz: case CJMPnz: case CALLC: case MAKE_ARRAY: case LINE:
+      insn->args[insn->args_num++] = INT;
+      break;
+    case BEGIN: case CBEGIN: case CALL: case TAG: case FAIL_I:
+      insn->args[insn->args_num++] = INT;
+      insn->args[insn->args_num++] = INT;
+      break;
+    case MAKE_CLOSURE:
+      insn->args[insn->args_num++] = INT;
+      insn->args[insn->args_num++] = INT;
+      if (insn->args[1] < 0) FAIL;
+      CHECK((long) insn->args[1] * (1 + sizeof(int)));
+      insn->captures = ip;
+      for (int i = 0; i < insn->args[1]; i++, ip += 1 + sizeof(int))
       {
-      case 0:
-        fprintf(f, "CONST\t%d", INT);
-        break;
+        if (*ip > CLOSURE_VAR) FAIL;
+      }
+      break;
+    default:
+      FAIL;
+    }
+    break;
 
-      case 1:
-        fprintf(f, "STRING\t%s", STRING);
-        break;
+  case PATT:
+    if (insn->l > PATT_CLOSURE) FAIL;
+    break;
 
-      case 2:
-        fprintf(f, "SEXP\t%s ", STRING);
-        fprintf(f, "%d", INT);
-        break;
+  case BUILTIN:
+    if (insn->l == BUILTIN_Barray) insn->args[insn->args_num++] = INT;
+    else if (insn->l > BUILTIN_Barray) FAIL;
+    break;
 
-      case 3:
-        fprintf(f, "STI");
-        break;
+  default:
+    FAIL;
+  }
+  insn->next = ip - bf->code_ptr;
 
-      case 4:
-        fprintf(f, "STA");
-        break;
+#undef CHECK
+#undef INT
+#undef FAIL
+}
 
-      case 5:
-        fprintf(f, "JMP\t0x%.8x", INT);
-        break;
+/* Encodes the instruction into the buffer and returns its size, the inverse of decode_instruction */
+unsigned int encode_instruction(const instruction *insn, char *out)
+{
+  char *p = out;
+  *p++ = (char) (insn->h << 4 | insn->l);
+  for (int i = 0; i < insn->args_num; i++, p += sizeof(int))
+  {
+    memcpy(p, &insn->args[i], sizeof(int));
+  }
+  if (insn->captures != NULL)
+  {
+    const size_t size = insn->args[1] * (1 + sizeof(int));
+    memmove(p, insn->captures, size);
+    p += size;
+  }
+  return p - out;
+}
 
-      case 6:
-        fprintf(f, "END");
-        break;
+/* Returns the encoded size of the instruction */
+unsigned int instruction_size(const instruction *insn)
+{
+  return 1 + insn->args_num * sizeof(int) + (insn->captures != NULL ? insn->args[1] * (1 + sizeof(int)) : 0);
+}
 
-      case 7:
-        fprintf(f, "RET");
-        break;
+/* Reads the i-th captured variable of a decoded CLOSURE */
+void closure_capture(const instruction *insn, const int i, unsigned char *designation, int *index)
+{
+  const char *p = insn->captures + i * (1 + sizeof(int));
+  *designation = *p;
+  memcpy(index, p + 1, sizeof(int));
+}
 
-      case 8:
-        fprintf(f, "DROP");
-        break;
+/* Returns the code offset the instruction may transfer control to or -1: jump, call and closure targets */
+int instruction_target(const instruction *insn)
+{
+  if ((insn->h == CONST && insn->l == JMP) ||
+      (insn->h == CONTROL && (insn->l == CJMPz || insn->l == CJMPnz || insn->l == CALL || insn->l == MAKE_CLOSURE)))
+    return insn->args[0];
+  return -1;
+}
 
-      case 9:
-        fprintf(f, "DUP");
-        break;
+/* Stores the number of operand stack values the instruction pops and pushes */
+void instruction_stack_effect(const instruction *insn, int *pops, int *pushes)
+{
+  *pops = 0;
+  *pushes = 0;
+  switch (insn->h)
+  {
+  case BINOP: *pops = 2; *pushes = 1; break;
+  case CONST:
+    switch (insn->l)
+    {
+    case CONST_INT: case CONST_STRING: *pushes = 1; break;
+    case MAKE_SEXP: *pops = insn->args[1]; *pushes = 1; break;
+    case STI: *pops = 2; *pushes = 1; break;
+    case STA: *pops = 3; *pushes = 1; break;
+    case END: case RET: case DROP: *pops = 1; break;
+    case DUP: *pops = 1; *pushes = 2; break;
+    case SWAP: case ELEM: *pops = 2; *pushes = insn->l == SWAP ? 2 : 1; break;
+    }
+    break;
+  case LD: case LDA: *pushes = 1; break;
+  case ST: *pops = 1; *pushes = 1; break;
+  case CONTROL:
+    switch (insn->l)
+    {
+    case CJMPz: case CJMPnz: *pops = 1; break;
+    case MAKE_CLOSURE: *pushes = 1; break;
+    case CALLC: *pops = insn->args[0] + 1; *pushes = 1; break;
+    case CALL: *pops = insn->args[1]; *pushes = 1; break;
+    case TAG: case MAKE_ARRAY: *pops = 1; *pushes = 1; break;
+    }
+    break;
+  case PATT: *pops = insn->l == PATT_STR_EQ ? 2 : 1; *pushes = 1; break;
+  case BUILTIN:
+    switch (insn->l)
+    {
+    case BUILTIN_Lread: *pushes = 1; break;
+    case BUILTIN_Barray: *pops = insn->args[0]; *pushes = 1; break;
+    default: *pops = 1; *pushes = 1; break;
+    }
+    break;
+  }
+}
 
-      case 10:
-        fprintf(f, "SWAP");
-        break;
+/* Returns true if the execution never falls through to the next instruction */
+int instruction_is_terminal(const instruction *insn)
+{
+  return insn->h == STOP ||
+         (insn->h == CONST && (insn->l == JMP || insn->l == END || insn->l == RET)) ||
+         (insn->h == CONTROL && insn->l == FAIL_I);
+}
 
-      case 11:
-        fprintf(f, "ELEM");
-        break;
+static const char *const ops[] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
+static const char *const pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
+static const char *const lds[] = {"LD", "LDA", "ST"};
+static const char *const designations = "GLAC";
 
-      default:
-        FAIL;
-      }
-      break;
+/* Prints the instruction in the dump_file syntax, without the offset and the trailing newline */
+void print_instruction(FILE *f, const bytefile *bf, const instruction *insn)
+{
+  const int *a = insn->args;
+  switch (insn->h)
+  {
+  case STOP:
+    fputs("<end>", f);
+    break;
 
-    case 2:
-    case 3:
-    case 4:
-      fprintf(f, "%s\t", lds[h - 2]);
-      switch (l)
-      {
-      case 0:
-        fprintf(f, "G(%d)", INT);
-        break;
-      case 1:
-        fprintf(f, "L(%d)", INT);
-        break;
-      case 2:
-        fprintf(f, "A(%d)", INT);
-        break;
-      case 3:
-        fprintf(f, "C(%d)", INT);
-        break;
-      default:
-        FAIL;
-      }
-      break;
+  case BINOP:
+    fprintf(f, "BINOP\t%s", insn->l >= 1 && insn->l <= 13 ? ops[insn->l - 1] : "?");
+    break;
 
-    case 5:
-      switch (l)
-      {
-      case 0:
-        fprintf(f, "CJMPz\t0x%.8x", INT);
-        break;
-
-      case 1:
-        fprintf(f, "CJMPnz\t0x%.8x", INT);
-        break;
-
-      case 2:
-        fprintf(f, "BEGIN\t%d ", INT);
-        fprintf(f, "%d", INT);
-        break;
-
-      case 3:
-        fprintf(f, "CBEGIN\t%d ", INT);
-        fprintf(f, "%d", INT);
-        break;
-
-      case 4:
-        fprintf(f, "CLOSURE\t0x%.8x", INT);
-        {
-          int n = INT;
-          for (int i = 0; i < n; i++)
-          {
-            switch (BYTE)
-            {
-            case 0:
-              fprintf(f, "G(%d)", INT);
-              break;
-            case 1:
-              fprintf(f, "L(%d)", INT);
-              break;
-            case 2:
-              fprintf(f, "A(%d)", INT);
-              break;
-            case 3:
-              fprintf(f, "C(%d)", INT);
-              break;
-            default:
-              FAIL;
-            }
-          }
-        };
-        break;
-
-      case 5:
-        fprintf(f, "CALLC\t%d", INT);
-        break;
-
-      case 6:
-        fprintf(f, "CALL\t0x%.8x ", INT);
-        fprintf(f, "%d", INT);
-        break;
-
-      case 7:
-        fprintf(f, "TAG\t%s ", STRING);
-        fprintf(f, "%d", INT);
-        break;
-
-      case 8:
-        fprintf(f, "ARRAY\t%d", INT);
-        break;
-
-      case 9:
-        fprintf(f, "FAIL\t%d", INT);
-        fprintf(f, "%d", INT);
-        break;
-
-      case 10:
-        fprintf(f, "LINE\t%d", INT);
-        break;
-
-      default:
-        FAIL;
-      }
-      break;
+  case CONST:
+    switch (insn->l)
+    {
+    case CONST_INT: fprintf(f, "CONST\t%d", a[0]); break;
+    case CONST_STRING: fprintf(f, "STRING\t%s", get_string(bf, a[0])); break;
+    case MAKE_SEXP: fprintf(f, "SEXP\t%s %d", get_string(bf, a[0]), a[1]); break;
+    case STI: fputs("STI", f); break;
+    case STA: fputs("STA", f); break;
+    case JMP: fprintf(f, "JMP\t0x%.8x", a[0]); break;
+    case END: fputs("END", f); break;
+    case RET: fputs("RET", f); break;
+    case DROP: fputs("DROP", f); break;
+    case DUP: fputs("DUP", f); break;
+    case SWAP: fputs("SWAP", f); break;
+    case ELEM: fputs("ELEM", f); break;
+    }
+    break;
 
-    case 6:
-      fprintf(f, "PATT\t%s", pats[l]);
-      break;
+  case LD:
+  case LDA:
+  case ST:
+    fprintf(f, "%s\t%c(%d)", lds[insn->h - LD], designations[insn->l], a[0]);
+    break;
 
-    case 7:
+  case CONTROL:
+    switch (insn->l)
     {
-      switch (l)
+    case CJMPz: fprintf(f, "CJMPz\t0x%.8x", a[0]); break;
+    case CJMPnz: fprintf(f, "CJMPnz\t0x%.8x", a[0]); break;
+    case BEGIN: fprintf(f, "BEGIN\t%d %d", a[0], a[1]); break;
+    case CBEGIN: fprintf(f, "CBEGIN\t%d %d", a[0], a[1]); break;
+    case MAKE_CLOSURE:
+      fprintf(f, "CLOSURE\t0x%.8x", a[0]);
+      for (int i = 0; i < a[1]; i++)
       {
-      case 0:
-        fprintf(f, "CALL\tLread");
-        break;
+        unsigned char designation;
+        int index;
+        closure_capture(insn, i, &designation, &index);
+        fprintf(f, " %c(%d)", designations[designation], index);
+      }
+      break;
+    case CALLC: fprintf(f, "CALLC\t%d", a[0]); break;
+    case CALL: fprintf(f, "CALL\t0x%.8x %d", a[0], a[1]); break;
+    case TAG: fprintf(f, "TAG\t%s %d", get_string(bf, a[0]), a[1]); break;
+    case MAKE_ARRAY: fprintf(f, "ARRAY\t%d", a[0]); break;
+    case FAIL_I: fprintf(f, "FAIL\t%d %d", a[0], a[1]); break;
+    case LINE: fprintf(f, "LINE\t%d", a[0]); break;
+    }
+    break;
 
-      case 1:
-        fprintf(f, "CALL\tLwrite");
-        break;
+  case PATT:
+    fprintf(f, "PATT\t%s", pats[insn->l]);
+    break;
 
-      case 2:
-        fprintf(f, "CALL\tLlength");
-        break;
+  case BUILTIN:
+    switch (insn->l)
+    {
+    case BUILTIN_Lread: fputs("CALL\tLread", f); break;
+    case BUILTIN_Lwrite: fputs("CALL\tLwrite", f); break;
+    case BUILTIN_Llength: fputs("CALL\tLlength", f); break;
+    case BUILTIN_Lstring: fputs("CALL\tLstring", f); break;
+    case BUILTIN_Barray: fprintf(f, "CALL\tBarray\t%d", a[0]); break;
+    }
+    break;
+  }
+}
 
-      case 3:
-        fprintf(f, "CALL\tLstring");
-        break;
+void dump_header(FILE *f, const bytefile *bf)
+{
+  int i;
 
-      case 4:
-        fprintf(f, "CALL\tBarray\t%d", INT);
-        break;
+  fprintf(f, "String table size       : %d\n", bf->stringtab_size);
+  fprintf(f, "Global area size        : %d\n", bf->global_area_size);
+  fprintf(f, "Number of public symbols: %d\n", bf->public_symbols_number);
+  fprintf(f, "Public symbols          :\n");
 
-      default:
-        FAIL;
-      }
-    }
-    break;
+  for (i = 0; i < bf->public_symbols_number; i++)
+    fprintf(f, "   0x%.8x: %s\n", get_public_offset(bf, i), get_public_name(bf, i));
 
-    default:
-      FAIL;
-    }
+}
 
-    fprintf(f, "\n");
-  } while (1);
-stop:
-  fprintf(f, "<end>\n");
-}
\ No newline at end of file
+void dump_file(FILE *f, const bytefile *bf)
+{
+  dump_header(f, bf);
+  fprintf(f, "Code:\n");
+  instruction insn;
+  unsigned int offset = 0;
+  do
+  {
+    decode_instruction(bf, offset, &insn);
+    fprintf(f, "0x%.8x:\t", insn.offset);
+    print_instruction(f, bf, &insn);
+    fputc('\n', f);
+    offset = insn.next;
+  } while (insn.h != STOP);
+}
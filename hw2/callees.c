@@ -0,0 +1,207 @@
+//
+// Closures of known functions over the bytecode
+//
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "callees.h"
+#include "runtime.h"
+
+// The abstract value of a variable or an operand stack position: the code offset of the function of the closure it
+// holds on every path, or unknown
+#define UNKNOWN (-1)
+
+typedef struct {
+  const program *p;
+  const function *f;
+  const int *globals;           // Global index -> code offset of the closures stored to it, UNKNOWN otherwise
+  int vars;                     // Arguments and locals, followed by the operand stack positions in a state
+  int width;
+  bool addressed;               // The function takes the address of a variable, which STA may then change
+  int *position;                // Instruction index -> position in the function being analyzed
+} context;
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+/* Returns the variable index of an argument or a local, -1 for globals and captured variables */
+static int variable(const function *f, const unsigned char designation, const int index) {
+  switch (designation) {
+    case ARG:
+      return index >= 0 && index < f->args_num ? index : -1;
+    case LOCAL:
+      return index >= 0 && index < f->locals_num ? f->args_num + index : -1;
+    default:
+      return -1;
+  }
+}
+
+static bool is_global(const program *p, const instruction *i) {
+  return i->l == GLOBAL && i->args[0] >= 0 && i->args[0] < p->bf->global_area_size;
+}
+
+/* Computes the values after the instruction in place */
+static void transfer(const context *c, const instruction *i, int *s, const int depth) {
+  int *stack = s + c->vars;
+  int pops, pushes;
+  switch (i->h) {
+    case LD: {
+      const int v = variable(c->f, i->l, i->args[0]);
+      if (v >= 0 && !c->addressed) {
+        stack[depth] = s[v];
+      } else {
+        stack[depth] = is_global(c->p, i) ? c->globals[i->args[0]] : UNKNOWN;
+      }
+      return;
+    }
+    case ST: {
+      const int v = variable(c->f, i->l, i->args[0]);
+      if (v >= 0) s[v] = stack[depth - 1];
+      return;
+    }
+    case CONST:
+      switch (i->l) {
+        case DUP:
+          stack[depth] = stack[depth - 1];
+          return;
+        case SWAP: {
+          const int v = stack[depth - 2];
+          stack[depth - 2] = stack[depth - 1];
+          stack[depth - 1] = v;
+          return;
+        }
+        default:
+          break;
+      }
+      break;
+    case CONTROL:
+      if (i->l == MAKE_CLOSURE) {
+        stack[depth] = i->args[0];
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+  instruction_stack_effect(i, &pops, &pushes);
+  for (int k = depth - pops; k < depth - pops + pushes; k++) {
+    stack[k] = UNKNOWN;
+  }
+}
+
+/* Merges the values into the state before the successor */
+static bool merge(const context *c, const int *from, int *to, const int depth, bool *reached) {
+  if (!*reached) {
+    memcpy(to, from, c->width * sizeof(int));
+    *reached = true;
+    return true;
+  }
+  bool changed = false;
+  for (int k = 0; k < c->vars + depth; k++) {
+    if (to[k] != from[k] && to[k] != UNKNOWN) {
+      to[k] = UNKNOWN;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+/* Whether the closure calls a function of the arguments the CALLC passes */
+static bool callable(const program *p, const int offset, const int args_num) {
+  if (offset < 0 || offset >= p->bf->code_size || p->index[offset] < 0 || p->owner[p->index[offset]] < 0) {
+    return false;
+  }
+  const function *f = &p->functions[p->owner[p->index[offset]]];
+  return f->begin == offset && f->args_num == args_num;
+}
+
+/* Records the closures the CALLC instructions call and the values the ST instructions store into globals */
+static void analyze_function(context *c, int *callees, int *stored) {
+  const program *p = c->p;
+  const function *f = c->f;
+  c->vars = f->args_num + f->locals_num;
+  c->width = c->vars + f->max_depth + 1;
+  c->addressed = false;
+  for (int k = 0; k < f->insns_num; k++) {
+    c->position[f->insns[k]] = k;
+    c->addressed |= p->insns[f->insns[k]].h == LDA;
+  }
+  int *in = checked_calloc((size_t) f->insns_num * c->width, sizeof(int));
+  bool *reached = checked_calloc(f->insns_num, sizeof(bool));
+  int *out = checked_calloc(c->width, sizeof(int));
+  const int entry = c->position[p->index[f->begin]];
+  memset(&in[(size_t) entry * c->width], UNKNOWN, c->width * sizeof(int));
+  reached[entry] = true;
+
+  bool changed;
+  do {
+    changed = false;
+    for (int k = 0; k < f->insns_num; k++) {
+      if (!reached[k]) continue;
+      const int insn = f->insns[k];
+      memcpy(out, &in[(size_t) k * c->width], c->width * sizeof(int));
+      transfer(c, &p->insns[insn], out, p->depth[insn]);
+      int succ[2];
+      const int n = instruction_successors(p, insn, succ);
+      for (int s = 0; s < n; s++) {
+        const int j = c->position[succ[s]];
+        changed |= merge(c, out, &in[(size_t) j * c->width], p->depth[succ[s]], &reached[j]);
+      }
+    }
+  } while (changed);
+
+  for (int k = 0; k < f->insns_num; k++) {
+    if (!reached[k]) continue;
+    const int insn = f->insns[k];
+    const instruction *i = &p->insns[insn];
+    const int *stack = &in[(size_t) k * c->width + c->vars];
+    const int depth = p->depth[insn];
+    if (i->h == CONTROL && i->l == CALLC) {
+      const int closure = stack[depth - i->args[0] - 1];
+      callees[insn] = callable(p, closure, i->args[0]) ? closure : UNKNOWN;
+    } else if (i->h == ST && is_global(p, i)) {
+      int *g = &stored[i->args[0]];
+      *g = *g == -2 || *g == stack[depth - 1] ? stack[depth - 1] : UNKNOWN;
+    } else if (i->h == LDA && is_global(p, i)) {
+      stored[i->args[0]] = UNKNOWN;
+    }
+  }
+  free(out);
+  free(reached);
+  free(in);
+}
+
+int *find_callees(const program *p) {
+  int *callees = checked_calloc(p->insns_num, sizeof(int));
+  int *globals = checked_calloc(p->bf->global_area_size, sizeof(int));
+  int *stored = checked_calloc(p->bf->global_area_size, sizeof(int));
+  context c = {.p = p, .globals = globals, .position = checked_calloc(p->insns_num, sizeof(int))};
+  memset(globals, UNKNOWN, p->bf->global_area_size * sizeof(int));
+  // The first pass finds the globals always holding closures of one function, the second one follows them. A value
+  // known in the first pass stays the same in the second, so the stores it found remain valid
+  for (int pass = 0; pass < 2; pass++) {
+    memset(callees, UNKNOWN, p->insns_num * sizeof(int));
+    // -2 marks a global with no store yet
+    for (int g = 0; g < p->bf->global_area_size; g++) {
+      stored[g] = -2;
+    }
+    for (int f = 0; f < p->functions_num; f++) {
+      c.f = &p->functions[f];
+      analyze_function(&c, callees, stored);
+    }
+    for (int g = 0; g < p->bf->global_area_size; g++) {
+      globals[g] = stored[g] >= 0 ? stored[g] : UNKNOWN;
+    }
+  }
+  free(c.position);
+  free(stored);
+  free(globals);
+  return callees;
+}
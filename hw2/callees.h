@@ -0,0 +1,18 @@
+//
+// Load-time devirtualization. A forward abstract interpretation of every
+// function tracks which arguments, locals and operand stack positions hold a
+// closure of a known function: one made by MAKE_CLOSURE in the function or
+// loaded from a global every store to which is such a closure. A CALLC of a
+// known closure becomes a direct call, the closure stays below the
+// arguments for the captured variables of the callee.
+//
+
+#ifndef HW2_CALLEES_H
+#define HW2_CALLEES_H
+
+#include "analysis.h"
+
+/* Returns instruction index -> code offset of the function a CALLC always calls, -1 for other instructions */
+int *find_callees(const program *p);
+
+#endif //HW2_CALLEES_H
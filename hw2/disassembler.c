@@ -0,0 +1,202 @@
+/* Lama SM bytecode disassembler and analyzer */
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "interpreter.h"
+#include "bytecode.h"
+#include "optimizer.h"
+#include "./runtime/runtime.h"
+
+// Output is written through a large stdio buffer instead of flushing line by line
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+typedef enum { REF_JUMP, REF_CALL, REF_CLOSURE, REF_STRING } ref_kind;
+
+typedef struct {
+  unsigned int from;            // Offset of the referencing instruction
+  unsigned int to;              // Referenced code offset or string table offset
+  ref_kind kind;
+} ref;
+
+typedef struct {
+  instruction *insns;
+  int insns_num;
+  ref *code_refs;               // Sorted by target
+  int code_refs_num;
+  ref *string_refs;             // Sorted by string offset
+  int string_refs_num;
+  unsigned long long *counts;   // Per-offset execution counts from a profile, NULL if not given
+} analysis;
+
+static const char *const ref_names[] = {"jump", "call", "closure", "string"};
+
+static void *checked_malloc(const size_t size) {
+  void *p = malloc(size == 0 ? 1 : size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static int compare_refs(const void *a, const void *b) {
+  const ref *x = a, *y = b;
+  if (x->to != y->to) return x->to < y->to ? -1 : 1;
+  return x->from < y->from ? -1 : x->from > y->from;
+}
+
+/* Decodes the whole code section and collects cross-references */
+static void analyze(const bytefile *bf, analysis *a) {
+  // Every instruction takes at least one byte, so code_size bounds the number of instructions and references
+  a->insns = checked_malloc(bf->code_size * sizeof(instruction));
+  a->code_refs = checked_malloc(bf->code_size * sizeof(ref));
+  a->string_refs = checked_malloc(bf->code_size * sizeof(ref));
+  a->insns_num = a->code_refs_num = a->string_refs_num = 0;
+
+  unsigned int offset = 0;
+  instruction *insn;
+  do {
+    insn = &a->insns[a->insns_num++];
+    decode_instruction(bf, offset, insn);
+    offset = insn->next;
+
+    const int target = instruction_target(insn);
+    if (target >= 0) {
+      ref *r = &a->code_refs[a->code_refs_num++];
+      r->from = insn->offset;
+      r->to = target;
+      r->kind = insn->h == CONTROL && insn->l == CALL ? REF_CALL
+              : insn->h == CONTROL && insn->l == MAKE_CLOSURE ? REF_CLOSURE
+              : REF_JUMP;
+    }
+    if ((insn->h == CONST && (insn->l == CONST_STRING || insn->l == MAKE_SEXP)) ||
+        (insn->h == CONTROL && insn->l == TAG)) {
+      ref *r = &a->string_refs[a->string_refs_num++];
+      r->from = insn->offset;
+      r->to = insn->args[0];
+      r->kind = REF_STRING;
+    }
+  } while (insn->h != STOP && offset < bf->code_size);
+
+  qsort(a->code_refs, a->code_refs_num, sizeof(ref), compare_refs);
+  qsort(a->string_refs, a->string_refs_num, sizeof(ref), compare_refs);
+}
+
+/* Finds the first reference to the target in a sorted array */
+static const ref *first_ref(const ref *refs, const int n, const unsigned int to) {
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (refs[mid].to < to) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo < n && refs[lo].to == to ? &refs[lo] : NULL;
+}
+
+static const char *function_name(const bytefile *bf, const unsigned int offset) {
+  for (unsigned int i = 0; i < bf->public_symbols_number; i++) {
+    if (get_public_offset(bf, i) == offset) return get_public_name(bf, i);
+  }
+  return NULL;
+}
+
+static void print_refs(FILE *f, const ref *r, const ref *end, const unsigned int to) {
+  for (; r != NULL && r < end && r->to == to; r++) {
+    fprintf(f, " %s@0x%.8x", ref_names[r->kind], r->from);
+  }
+}
+
+/* Prints a function boundary, with a profile the count of its BEGIN is the number of calls */
+static void print_function_header(FILE *f, const bytefile *bf, const analysis *a, const instruction *insn) {
+  const char *name = function_name(bf, insn->offset);
+  fprintf(f, "\n; %s 0x%.8x: %d args, %d locals%s",
+          name != NULL ? name : "function", insn->offset, insn->args[0], insn->args[1],
+          insn->l == CBEGIN ? ", closure" : "");
+  if (a->counts != NULL) {
+    fprintf(f, ", %llu calls", a->counts[insn->offset]);
+  }
+  fputc('\n', f);
+}
+
+static void print_code(FILE *f, const bytefile *bf, const analysis *a) {
+  const ref *refs_end = a->code_refs + a->code_refs_num;
+  for (int i = 0; i < a->insns_num; i++) {
+    const instruction *insn = &a->insns[i];
+    if (insn->h == CONTROL && (insn->l == BEGIN || insn->l == CBEGIN)) {
+      print_function_header(f, bf, a, insn);
+    }
+    const ref *r = first_ref(a->code_refs, a->code_refs_num, insn->offset);
+    if (r != NULL) {
+      fputs(";   referenced by", f);
+      print_refs(f, r, refs_end, insn->offset);
+      fputc('\n', f);
+    }
+    if (a->counts != NULL) {
+      if (a->counts[insn->offset] != 0) fprintf(f, "%14llu  ", a->counts[insn->offset]);
+      else fputs("             -  ", f);
+    }
+    fprintf(f, "0x%.8x:\t", insn->offset);
+    print_instruction(f, bf, insn);
+    fputc('\n', f);
+  }
+}
+
+static void print_strings(FILE *f, const bytefile *bf, const analysis *a) {
+  const ref *refs_end = a->string_refs + a->string_refs_num;
+  fputs("\nStrings:\n", f);
+  for (unsigned int pos = 0; pos < bf->stringtab_size; pos += strlen(&bf->string_ptr[pos]) + 1) {
+    fprintf(f, "   0x%.8x: \"%s\"", pos, &bf->string_ptr[pos]);
+    print_refs(f, first_ref(a->string_refs, a->string_refs_num, pos), refs_end, pos);
+    fputc('\n', f);
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [--profile FILE | --optimize] <file.bc>\n", name);
+  exit(1);
+}
+
+int main(const int argc, char *argv[]) {
+  static const struct option options[] = {
+    {"profile", required_argument, NULL, 'p'},
+    {"optimize", no_argument, NULL, 'O'},
+    {NULL, 0, NULL, 0}
+  };
+  const char *profile_file = NULL;
+  int optimization = 0;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+      case 'p':
+        profile_file = optarg;
+        break;
+      case 'O':
+        optimization = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  // Profiles are collected on the original code
+  if (optind + 1 != argc || (optimization && profile_file != NULL)) {
+    usage(argv[0]);
+  }
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+  const bytefile *bf = read_file(argv[optind]);
+  if (optimization) {
+    optimize((bytefile *) bf, NULL);
+  }
+  analysis a;
+  analyze(bf, &a);
+  a.counts = profile_file != NULL ? read_profile(profile_file, bf) : NULL;
+
+  dump_header(stdout, bf);
+  printf("Code:\n");
+  print_code(stdout, bf, &a);
+  print_strings(stdout, bf, &a);
+  return 0;
+}
@@ -0,0 +1,446 @@
+//
+// Escape analysis of arrays and s-expressions over the bytecode
+//
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "escape.h"
+#include "runtime.h"
+
+// The abstract value of an operand stack position: the instruction index of the allocation or the CALL whose object
+// it holds, a small integer or unknown. Objects that meet at a merge with the same shape become one value, whose index
+// is that of one of them. Integers are tracked for the indices of ELEM and the outcomes of ARRAY and TAG, so
+// that a jump on a check of a replaced object is known to be taken or not
+#define UNKNOWN (-1)
+#define INT_VALUE(k) (-2 - (k))
+#define IS_INT(v) ((v) <= -2)
+#define INT_OF(v) (-2 - (v))
+#define MAX_TRACKED_INT 64
+
+// Objects with more fields are always allocated
+#define MAX_FIELDS 16
+
+typedef struct {
+  const program *p;
+  int function;                 // Index of the function being analyzed
+  int depth;                    // Positions of a state
+  int *position;                // Instruction index -> position in the function being analyzed
+  int *parent;                  // Instruction index -> an object merged with the one made there, itself for the value
+  bool *escapes;                // Instruction index of a value -> its objects escape
+  bool escaped;                 // The values computed so far are invalid: an object was found to escape or merged,
+                                // or what a function returns changed
+  bool *returning;              // Function index -> every call is direct and may get the fields of its result
+  int *returns;                 // Function index -> allocation of the shape of the objects it returns, -1 if none yet
+  bool widened;                 // A function was found to return objects or to return values during the current pass
+  int maps_num;                 // Words of the field maps taken and allocated
+  int maps_capacity;
+} context;
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static int fields_num(const instruction *i) {
+  return i->h == BUILTIN ? i->args[0] : i->args[1];
+}
+
+static bool is_allocation(const instruction *i) {
+  if ((i->h == CONST && i->l == MAKE_SEXP) || (i->h == BUILTIN && i->l == BUILTIN_Barray)) {
+    return fields_num(i) > 0 && fields_num(i) <= MAX_FIELDS;
+  }
+  return false;
+}
+
+static int callee(const program *p, const instruction *i) {
+  return p->owner[p->index[i->args[0]]];
+}
+
+/* Whether the instruction makes an object whose fields may be kept in the frame: an allocation or a CALL of a
+   function that returns a fresh object on every path */
+static bool makes_object(const context *c, const instruction *i) {
+  if (i->h == CONTROL && i->l == CALL) {
+    const int f = callee(c->p, i);
+    return c->returning[f] && c->returns[f] >= 0;
+  }
+  return is_allocation(i);
+}
+
+static int value_of(context *c, int insn) {
+  if (insn < 0) return insn;
+  while (c->parent[insn] != insn) {
+    insn = c->parent[insn] = c->parent[c->parent[insn]];
+  }
+  return insn;
+}
+
+/* Allocation with the number of fields, the kind and the tag of the objects of the value */
+static int shape(const context *c, const int value) {
+  const instruction *i = &c->p->insns[value];
+  return i->h == CONTROL && i->l == CALL ? c->returns[callee(c->p, i)] : value;
+}
+
+static bool same_shape(const program *p, const int a, const int b) {
+  const instruction *x = &p->insns[a], *y = &p->insns[b];
+  return x->h == y->h && fields_num(x) == fields_num(y) &&
+         (x->h == BUILTIN || strcmp(get_string(p->bf, x->args[0]), get_string(p->bf, y->args[0])) == 0);
+}
+
+/* Outcome of ARRAY or TAG on the object allocated by the instruction */
+static int check_outcome(const program *p, const instruction *allocation, const instruction *check) {
+  if (fields_num(allocation) != (check->l == TAG ? check->args[1] : check->args[0])) return 0;
+  if (check->l == MAKE_ARRAY) return allocation->h == BUILTIN;
+  return allocation->h == CONST &&
+         strcmp(get_string(p->bf, allocation->args[0]), get_string(p->bf, check->args[0])) == 0;
+}
+
+static void escape(context *c, int value) {
+  value = value_of(c, value);
+  if (value >= 0 && !c->escapes[value]) {
+    c->escapes[value] = true;
+    c->escaped = true;
+  }
+}
+
+/* A function that returns anything but a fresh object of one shape returns values to all its callers */
+static void return_values(context *c, const int f) {
+  if (c->returning[f]) {
+    c->returning[f] = false;
+    c->widened = true;
+    c->escaped = true;
+  }
+}
+
+/* Pushes the object made by the instruction, a previous object of the same value that is still on the stack escapes */
+static void push_object(context *c, const int insn, int *s, const int depth) {
+  const int value = value_of(c, insn);
+  for (int k = 0; k < depth; k++) {
+    if (s[k] == value) escape(c, value);
+  }
+  s[depth] = c->escapes[value] ? UNKNOWN : value;
+}
+
+/* Computes the values after the instruction in place and returns its successors, of which a jump on a known
+   integer has one */
+static int transfer(context *c, const int insn, int *s, int succ[2]) {
+  const program *p = c->p;
+  const instruction *i = &p->insns[insn];
+  int depth = p->depth[insn];
+  const int n = instruction_successors(p, insn, succ);
+  int pops, pushes;
+  instruction_stack_effect(i, &pops, &pushes);
+  for (int k = 0; k < depth; k++) {
+    s[k] = value_of(c, s[k]);
+  }
+  if (makes_object(c, i)) {
+    // Fields escape into the object, and so do the arguments of a call
+    for (int k = depth - pops; k < depth; k++) {
+      escape(c, s[k]);
+    }
+    push_object(c, insn, s, depth - pops);
+    return n;
+  }
+  switch (i->h) {
+    case CONST:
+      switch (i->l) {
+        case CONST_INT:
+          s[depth] = i->args[0] >= 0 && i->args[0] < MAX_TRACKED_INT ? INT_VALUE(i->args[0]) : UNKNOWN;
+          return n;
+        case DUP:
+          s[depth] = s[depth - 1];
+          return n;
+        case SWAP: {
+          const int v = s[depth - 2];
+          s[depth - 2] = s[depth - 1];
+          s[depth - 1] = v;
+          return n;
+        }
+        case DROP:
+          return n;
+        case ELEM: {
+          const int object = s[depth - 2], index = s[depth - 1];
+          escape(c, index);
+          if (object >= 0 && !(IS_INT(index) && INT_OF(index) < fields_num(&p->insns[shape(c, object)]))) {
+            escape(c, object);
+          }
+          s[depth - 2] = UNKNOWN;
+          return n;
+        }
+        case END:
+        case RET: {
+          // A returned object leaves the function in the frame of the caller, if every return is such an object
+          const int f = c->function, v = depth > 0 ? s[depth - 1] : UNKNOWN;
+          if (c->returning[f] && v >= 0 && (c->returns[f] < 0 || same_shape(p, c->returns[f], shape(c, v)))) {
+            if (c->returns[f] < 0) {
+              // Recursive calls analyzed before are objects from now on
+              c->returns[f] = shape(c, v);
+              c->widened = true;
+              c->escaped = true;
+            }
+            return n;
+          }
+          return_values(c, f);
+          break;
+        }
+        default:
+          break;
+      }
+      break;
+    case ST:
+      escape(c, s[depth - 1]);
+      return n;
+    case CONTROL:
+      switch (i->l) {
+        case CJMPz:
+        case CJMPnz: {
+          const int v = s[depth - 1];
+          escape(c, v);
+          if (IS_INT(v)) {
+            const bool taken = (INT_OF(v) == 0) == (i->l == CJMPz);
+            succ[0] = taken ? succ[0] : insn + 1;
+            return 1;
+          }
+          return n;
+        }
+        case TAG:
+        case MAKE_ARRAY: {
+          const int v = s[depth - 1];
+          s[depth - 1] = v >= 0 ? INT_VALUE(check_outcome(p, &p->insns[shape(c, v)], i)) : UNKNOWN;
+          return n;
+        }
+        case FAIL_I:
+          // The value that failed to match is not printed
+          return n;
+        default:
+          break;
+      }
+      break;
+    default:
+      break;
+  }
+  // Everything else takes its operands as they are and pushes unknown values
+  for (int k = depth - pops; k < depth; k++) {
+    escape(c, s[k]);
+  }
+  depth -= pops;
+  for (int k = 0; k < pushes; k++) {
+    s[depth++] = UNKNOWN;
+  }
+  return n;
+}
+
+/* Merges the values into the ones before the successor. Objects of one shape become one value that keeps its fields
+   in the same slots on either path, an object meeting anything else escapes */
+static bool merge(context *c, const int *from, int *to, const int depth, bool *reached) {
+  if (!*reached) {
+    memcpy(to, from, c->depth * sizeof(int));
+    *reached = true;
+    return true;
+  }
+  bool changed = false;
+  for (int k = 0; k < depth; k++) {
+    const int a = value_of(c, to[k]), b = value_of(c, from[k]);
+    if (a == b) {
+      to[k] = a;
+      continue;
+    }
+    if (a >= 0 && b >= 0 && !c->escapes[a] && !c->escapes[b] && same_shape(c->p, shape(c, a), shape(c, b))) {
+      c->parent[b] = a;
+      c->escaped = true;
+      to[k] = a;
+      continue;
+    }
+    escape(c, a);
+    escape(c, b);
+    changed |= to[k] != UNKNOWN;
+    to[k] = UNKNOWN;
+  }
+  return changed;
+}
+
+/* Returns the position of a new empty field map of the words */
+static int new_field_map(context *c, scalars *result, const int words) {
+  if (c->maps_num + words > c->maps_capacity) {
+    c->maps_capacity = (c->maps_num + words) * 2;
+    result->field_maps = realloc(result->field_maps, c->maps_capacity * sizeof(uint64_t));
+    if (result->field_maps == NULL) {
+      failure("*** FAILURE: unable to allocate memory.\n");
+    }
+  }
+  memset(&result->field_maps[c->maps_num], 0, words * sizeof(uint64_t));
+  c->maps_num += words;
+  return c->maps_num - words;
+}
+
+static void analyze_function(context *c, const function *f, scalars *result, int *slots_num) {
+  const program *p = c->p;
+  c->depth = f->max_depth + 1;
+  for (int k = 0; k < f->insns_num; k++) {
+    c->position[f->insns[k]] = k;
+  }
+  int *in = checked_calloc((size_t) f->insns_num * c->depth, sizeof(int));
+  bool *reached = checked_calloc(f->insns_num, sizeof(bool));
+  int *out = checked_calloc(c->depth, sizeof(int));
+  const int entry = c->position[p->index[f->begin]];
+
+  // Every object found to escape or merged invalidates the values computed so far, the analysis starts over
+  do {
+    c->escaped = false;
+    memset(reached, 0, f->insns_num * sizeof(bool));
+    reached[entry] = true;
+    bool changed;
+    do {
+      changed = false;
+      for (int k = 0; k < f->insns_num; k++) {
+        if (!reached[k]) continue;
+        const int insn = f->insns[k];
+        memcpy(out, &in[(size_t) k * c->depth], c->depth * sizeof(int));
+        int succ[2];
+        const int n = transfer(c, insn, out, succ);
+        for (int s = 0; s < n; s++) {
+          const int j = c->position[succ[s]];
+          changed |= merge(c, out, &in[(size_t) j * c->depth], p->depth[succ[s]], &reached[j]);
+        }
+        if (c->escaped) break;
+      }
+    } while (changed && !c->escaped);
+  } while (c->escaped);
+
+  // Merged objects share the slots of the value
+  int slots = 0;
+  for (int k = 0; k < f->insns_num; k++) {
+    const int insn = f->insns[k];
+    const int value = value_of(c, insn);
+    if (reached[k] && makes_object(c, &p->insns[insn]) && !c->escapes[value]) {
+      if (result->slot[value] < 0) {
+        result->slot[value] = slots;
+        slots += fields_num(&p->insns[shape(c, value)]);
+      }
+      result->slot[insn] = result->slot[value];
+    }
+  }
+  for (int k = 0; k < f->insns_num; k++) {
+    const int insn = f->insns[k];
+    const instruction *i = &p->insns[insn];
+    const int depth = p->depth[insn];
+    if (!reached[k]) continue;
+    const int *s = &in[(size_t) k * c->depth];
+    const int top = depth > 0 ? value_of(c, s[depth - 1]) : UNKNOWN;
+    if (i->h == CONST && i->l == ELEM && value_of(c, s[depth - 2]) >= 0) {
+      result->slot[insn] = result->slot[value_of(c, s[depth - 2])] + INT_OF(top);
+    } else if (i->h == CONTROL && (i->l == TAG || i->l == MAKE_ARRAY) && top >= 0) {
+      result->check[insn] = (signed char) check_outcome(p, &p->insns[shape(c, top)], i);
+    } else if (i->h == CONST && (i->l == END || i->l == RET) && top >= 0 && c->returning[c->function]) {
+      result->slot[insn] = result->slot[top];
+    }
+    // The collector keeps the fields of the objects that may still be read and clears the other slots
+    if (slots > 0) {
+      int pops, pushes;
+      instruction_stack_effect(i, &pops, &pushes);
+      const int map = new_field_map(c, result, (slots + 63) / 64);
+      for (int j = 0; j < depth - pops; j++) {
+        const int value = value_of(c, s[j]);
+        if (value < 0 || result->slot[value] < 0) continue;
+        for (int bit = result->slot[value]; bit < result->slot[value] + fields_num(&p->insns[shape(c, value)]); bit++) {
+          result->field_maps[map + bit / 64] |= (uint64_t) 1 << (bit % 64);
+        }
+      }
+      result->live_fields[insn] = map;
+    }
+  }
+  *slots_num = slots;
+  free(out);
+  free(reached);
+  free(in);
+}
+
+/* A function may return the fields of its result only if it is not an entry, is called directly with its arguments
+   and is never made into a closure, so that every caller knows what it calls */
+static void find_direct_functions(context *c) {
+  const program *p = c->p;
+  for (int f = 0; f < p->functions_num; f++) {
+    c->returning[f] = true;
+    c->returns[f] = -1;
+  }
+  c->returning[p->owner[p->index[p->bf->entrypoint_offset]]] = false;
+  for (unsigned int k = 0; k < p->bf->public_symbols_number; k++) {
+    const int offset = get_public_offset(p->bf, k);
+    if (offset >= 0 && (unsigned long) offset < p->bf->code_size && p->index[offset] >= 0 &&
+        p->owner[p->index[offset]] >= 0) {
+      c->returning[p->owner[p->index[offset]]] = false;
+    }
+  }
+  for (int insn = 0; insn < p->insns_num; insn++) {
+    const instruction *i = &p->insns[insn];
+    if (p->owner[insn] < 0 || i->h != CONTROL) continue;
+    if (i->l == MAKE_CLOSURE || (i->l == CALL && i->args[1] != p->functions[callee(p, i)].args_num)) {
+      c->returning[callee(p, i)] = false;
+    }
+  }
+}
+
+scalars *find_scalars(const program *p) {
+  scalars *result = checked_calloc(1, sizeof(scalars));
+  result->slot = checked_calloc(p->insns_num, sizeof(int));
+  result->check = checked_calloc(p->insns_num, sizeof(signed char));
+  result->slots_num = checked_calloc(p->functions_num, sizeof(int));
+  result->returned_fields = checked_calloc(p->functions_num, sizeof(int));
+  result->live_fields = checked_calloc(p->insns_num, sizeof(int));
+  context c = {
+    .p = p,
+    .position = checked_calloc(p->insns_num, sizeof(int)),
+    .parent = checked_calloc(p->insns_num, sizeof(int)),
+    .escapes = checked_calloc(p->insns_num, sizeof(bool)),
+    .returning = checked_calloc(p->functions_num, sizeof(bool)),
+    .returns = checked_calloc(p->functions_num, sizeof(int)),
+  };
+  for (int insn = 0; insn < p->insns_num; insn++) {
+    c.parent[insn] = insn;
+  }
+  find_direct_functions(&c);
+
+  // The results of calls depend on the returns of the callees, all functions are analyzed again until neither changes
+  do {
+    c.widened = false;
+    memset(result->slot, -1, p->insns_num * sizeof(int));
+    memset(result->check, -1, p->insns_num * sizeof(signed char));
+    memset(result->live_fields, -1, p->insns_num * sizeof(int));
+    c.maps_num = 0;
+    for (int f = 0; f < p->functions_num; f++) {
+      c.function = f;
+      analyze_function(&c, &p->functions[f], result, &result->slots_num[f]);
+    }
+    // A result that escapes at one call is made into an object for all callers
+    for (int insn = 0; insn < p->insns_num; insn++) {
+      const instruction *i = &p->insns[insn];
+      if (p->owner[insn] >= 0 && i->h == CONTROL && i->l == CALL && c.escapes[value_of(&c, insn)]) {
+        return_values(&c, callee(p, &p->insns[insn]));
+      }
+    }
+  } while (c.widened);
+
+  for (int f = 0; f < p->functions_num; f++) {
+    if (c.returning[f] && c.returns[f] >= 0) result->returned_fields[f] = fields_num(&p->insns[c.returns[f]]);
+  }
+  free(c.returns);
+  free(c.returning);
+  free(c.escapes);
+  free(c.parent);
+  free(c.position);
+  return result;
+}
+
+void free_scalars(scalars *s) {
+  free(s->slot);
+  free(s->check);
+  free(s->slots_num);
+  free(s->returned_fields);
+  free(s->field_maps);
+  free(s->live_fields);
+  free(s);
+}
@@ -0,0 +1,37 @@
+//
+// Load-time escape analysis. A forward abstract interpretation of every
+// function tracks which operand stack positions hold the array or
+// s-expression built at an allocation site. An object that is only
+// duplicated, dropped, checked by ARRAY or TAG and read by ELEM at constant
+// indices never leaves its function: it does not need to be allocated,
+// its fields are kept in slots of the frame instead. So is the object a
+// function returns on every path if all its calls are direct and each of
+// them only reads the result so: the fields are left to the caller.
+//
+
+#ifndef HW2_ESCAPE_H
+#define HW2_ESCAPE_H
+
+#include <stdint.h>
+
+#include "analysis.h"
+
+typedef struct {
+  int *slot;                    // Instruction index -> first field slot of a replaced Barray, SEXP or CALL result and
+                                // of the object a RET returns, the field slot an ELEM of a replaced object reads,
+                                // -1 otherwise
+  signed char *check;           // Instruction index -> outcome of an ARRAY or TAG of a replaced object, -1 otherwise
+  int *slots_num;               // Function index -> field slots of its frame
+  int *returned_fields;         // Function index -> fields of the object it returns that its RET leaves in the frame
+                                // of the caller instead, 0 if it returns a value
+  uint64_t *field_maps;         // Bitsets of the field slots of a frame, bit i for slot i
+  int *live_fields;             // Instruction index -> position in field_maps of the slots of the objects kept below
+                                // the operands the instruction takes, -1 if its function has no field slots
+} scalars;
+
+/* Finds the allocations that do not escape their function and assigns frame slots to their fields */
+scalars *find_scalars(const program *p);
+
+void free_scalars(scalars *s);
+
+#endif //HW2_ESCAPE_H
@@ -8,17 +8,45 @@
 #include <stdlib.h>
 
 #include "interpreter.h"
+#include "bytecode.h"
+#include "stackmap.h"
+#include "regir.h"
 #include "./runtime/runtime.c"
 
 #define EMPTY BOX(0)
 
+// Frames of the register machine that may be active at once
+#define CONTROL_STACK_SIZE (STACK_SIZE / 4)
+
+// A frame of the register machine on the control stack, the value stack holds only its arguments, locals and
+// operands. The GC never looks at the control stack except to walk the frames
+typedef struct {
+  aint *ebp;
+  const reg_insn *begin;        // BEGIN of the function, its shape
+  const reg_insn *ret;          // Calling instruction of the caller, NULL for main
+  aint *env;                    // Captured variables of the closure if the function accesses them
+} control_frame;
+
 typedef struct {
   char *ip;
   aint *ebp;
   const bytefile *bf;
+  const stack_maps *maps;
+  const reg_program *rp;        // Not NULL when the register machine runs
+  const reg_insn *pc;           // Instruction of the register machine the collector is called from
+  const control_frame *control; // Bottom and top of the control stack of the register machine
+  const control_frame *ctl;
 } State;
 
-static State state;
+// Every thread runs its own program
+static _Thread_local State state;
+
+// Kept for the next run of the thread, a run that failed leaves it as it is
+static _Thread_local control_frame *control_stack;
+
+_Thread_local bool count_instructions = false;
+_Thread_local unsigned long long executed_instructions = 0;
+_Thread_local unsigned long long *instruction_counts = NULL;
 
 #define ESP (((aint *) __gc_stack_top) + 1)
 
@@ -102,8 +130,7 @@ inline static data * safe_retrieve_closure(const aint closure_ptr) {
   return closure;
 }
 
-inline static aint * closure(const unsigned int index) {
-  const aint closure_ptr = *(state.ebp + 2);
+inline static aint * closure_field(const aint closure_ptr, const unsigned int index) {
   const data * closure = safe_retrieve_closure(closure_ptr);
   const ptrt captured_vars_num = LEN(closure->data_header) - 1;
   if (index >= captured_vars_num) {
@@ -112,13 +139,17 @@ inline static aint * closure(const unsigned int index) {
   return &((aint *) closure->contents)[1 + index]; // 1 + because the first arg of every closure is an offset
 }
 
+inline static aint * closure(const unsigned int index) {
+  return closure_field(*(state.ebp + 2), index);
+}
+
 inline static int read(const unsigned int bytes) {
   if (state.ip + bytes > state.bf->code_ptr + state.bf->code_size) {
     failure("When reading %d bytes IP counter %d can move outside of the code section of size\n", bytes, state.ip,
             state.bf->code_size);
   }
   state.ip += bytes;
-  return *(int *)(state.ip - bytes);
+  return bytes == 1 ? (unsigned char)state.ip[-1] : *(int *)(state.ip - bytes);
 }
 
 inline static void jump(const unsigned int offset) {
@@ -133,67 +164,75 @@ inline static void jump(const unsigned int offset) {
 #define STRING get_string(state.bf, INT)
 #define FAIL failure("ERROR: invalid opcode %d-%d\n", h, l)
 
-enum Instruction {
-  // High nibble values (h)
-  BINOP = 0,
-  CONST = 1,
-  LD = 2,
-  LDA = 3,
-  ST = 4,
-  CONTROL = 5,
-  PATT = 6,
-  BUILTIN = 7,
-  STOP = 15,
-
-  // Low nibble values for CONST group (h=1)
-  CONST_INT = 0,
-  CONST_STRING = 1,
-  MAKE_SEXP = 2,
-  STI = 3,
-  STA = 4,
-  JMP = 5,
-  END = 6,
-  RET = 7,
-  DROP = 8,
-  DUP = 9,
-  SWAP = 10,
-  ELEM = 11,
-
-  // Low nibble values for LD/LDA/ST variable locations
-  GLOBAL = 0,
-  LOCAL = 1,
-  ARG = 2,
-  CLOSURE_VAR = 3,
-
-  // Low nibble values for CONTROL group (h=5)
-  CJMPz = 0,
-  CJMPnz = 1,
-  BEGIN = 2,
-  CBEGIN = 3,
-  MAKE_CLOSURE = 4,
-  CALLC = 5,
-  CALL = 6,
-  TAG = 7,
-  MAKE_ARRAY = 8,
-  FAIL_I = 9,
-  LINE = 10,
-
-  // Low nibble values for PATT group (h=6)
-  PATT_STR_EQ = 0,
-  PATT_STRING = 1,
-  PATT_ARRAY = 2,
-  PATT_SEXP = 3,
-  PATT_BOXED = 4,
-  PATT_UNBOXED = 5,
-  PATT_CLOSURE = 6,
-
-  // Low nibble values for BUILTIN group (h=7)
-  BUILTIN_Lread = 0,
-  BUILTIN_Lwrite = 1,
-  BUILTIN_Llength = 2,
-  BUILTIN_Lstring = 3,
-  BUILTIN_Barray = 4
-};
+static void scan_slot(aint *slot, const uint64_t *map, const int var) {
+  if (map == NULL || stack_map_is_live(map, var)) {
+    gc_test_and_mark_root((size_t **) slot);
+  } else {
+    *slot = EMPTY;
+  }
+}
+
+/* Walks the frames from the top of the stack and marks the operand stacks, closures and the live arguments and
+   locals. The frame layout from higher to lower addresses is: args, closure, return ip, caller ebp (ebp points here),
+   BOX(args_num), BOX(locals_num), locals, operands */
+static void scan_stack(void) {
+  aint *top = ESP;
+  aint *ebp = state.ebp;
+  const char *ip = state.ip;
+  while (1) {
+    const int args_num = UNBOX(*(ebp - 1));
+    const int locals_num = UNBOX(*(ebp - 2));
+    const uint64_t *map = stack_map_at(state.maps, ip - state.bf->code_ptr);
+    for (aint *p = top; p < ebp - 2 - locals_num; p++) {
+      gc_test_and_mark_root((size_t **) p);
+    }
+    for (int i = 0; i < locals_num; i++) {
+      scan_slot(ebp - 3 - i, map, args_num + i);
+    }
+    if (ebp == state.bf->stack_ptr) break; // Arguments of main are not passed on the stack
+    gc_test_and_mark_root((size_t **) (ebp + 2));
+    for (int i = 0; i < args_num; i++) {
+      scan_slot(ebp + 3 + args_num - 1 - i, map, i);
+    }
+    top = ebp + 3 + args_num;
+    ip = (const char *) *(ebp + 1);
+    ebp = (aint *) *ebp;
+  }
+  for (aint *p = state.bf->global_ptr; p < (aint *) __gc_stack_bottom; p++) {
+    gc_test_and_mark_root((size_t **) p);
+  }
+}
+
+/* The same walk over the frames of the register machine, see regir.h for their layout. The frames are taken from
+   the control stack, the closure of a CALLC frame is scanned as an operand of the caller */
+static void scan_register_stack(void) {
+  aint *top = ESP;
+  const reg_insn *at = state.pc;
+  for (const control_frame *c = state.ctl; ; c--) {
+    aint *ebp = c->ebp;
+    const int args_num = c->begin->args_num;
+    const int locals_num = c->begin->locals_num;
+    const int fields_num = c->begin->fields_num;
+    for (aint *p = top; p < ebp - locals_num - fields_num; p++) {
+      gc_test_and_mark_root((size_t **) p);
+    }
+    for (int i = 0; i < fields_num; i++) {
+      scan_slot(ebp - 1 - locals_num - i, at->live_fields, i);
+    }
+    for (int i = 0; i < locals_num; i++) {
+      scan_slot(ebp - 1 - i, at->live, args_num + i);
+    }
+    if (c == state.control) break;
+    for (int i = 0; i < args_num; i++) {
+      scan_slot(ebp + args_num - 1 - i, at->live, i);
+    }
+    top = ebp + args_num;
+    at = c->ret;
+  }
+  for (aint *p = state.bf->global_ptr; p < (aint *) __gc_stack_bottom; p++) {
+    gc_test_and_mark_root((size_t **) p);
+  }
+}
 
 inline static aint * var(const unsigned char designation, const unsigned int index, const unsigned char h, const unsigned char l) {
   switch (designation) {
@@ -217,10 +256,17 @@ inline static aint * var(const unsigned char designation, const unsigned int ind
 inline static void eval_binop(unsigned char op);
 
 /* Disassembles the bytecode pool */
-void interpret(const bytefile *bf) {
+void interpret(const bytefile *bf, const stack_maps *maps) {
   state.ip = bf->code_ptr + bf->entrypoint_offset;
   state.ebp = bf->stack_ptr;
   state.bf = bf;
+  state.maps = maps;
+  state.rp = NULL;
+  if (maps != NULL) {
+    gc_scan_stack_hook = scan_stack;
+  }
+  unsigned long long *const counts = instruction_counts;
+  const bool counting = count_instructions;
 
   #ifdef DEBUG_PRINT
   static const char* const ops[] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
@@ -228,6 +274,12 @@ void interpret(const bytefile *bf) {
   #endif
   do {
     const unsigned char x = BYTE, h = (x & 0xF0) >> 4, l = x & 0x0F;
+    if (counting) {
+      executed_instructions++;
+    }
+    if (counts != NULL) {
+      counts[state.ip - bf->code_ptr - 1]++;
+    }
     #ifdef DEBUG_PRINT
       dump_stack();
     #endif
@@ -357,7 +409,11 @@ void interpret(const bytefile *bf) {
       case ST: {
         DEBUG_LOG("ST\t");
         const int index = INT;
-        *var(l, index, h, l) = *ESP;
+        aint *x = var(l, index, h, l);
+        if (l == CLOSURE_VAR) {
+          gc_write_barrier(x, (void *) *ESP);
+        }
+        *x = *ESP;
         break;
       }
 
@@ -524,10 +580,13 @@ void interpret(const bytefile *bf) {
             break;
           }
 
-          case BUILTIN_Lstring:
+          case BUILTIN_Lstring: {
             DEBUG_LOG("CALL\tLstring");
-            push((aint) Lstring(ESP));
+            const aint result = (aint) Lstring(ESP);
+            pop();
+            push(result);
             break;
+          }
 
           case BUILTIN_Barray: {
             const unsigned int len = INT;
@@ -554,101 +613,361 @@ void interpret(const bytefile *bf) {
     DEBUG_LOG("\n");
   } while (1);
 stop:
-  printf("<done>\n");
+  gc_scan_stack_hook = NULL;
+  fprintf(OUTPUT, "<done>\n");
 }
 
 enum Binop {
   ADD, SUB, MUL, DIV, MOD, LT, LTE, GT, GTE, EQ, NEQ, AND, OR
 };
 
-inline static void eval_binop(const unsigned char op) {
-  void *q = (void *) pop();
-  void *p = (void *) pop();
+/* Computes the BINOP operator over the operands, op is the low nibble minus one */
+inline static aint binop(const unsigned char op, const aint x, const aint y) {
+  void *p = (void *) x;
+  void *q = (void *) y;
   DEBUG_LOG("\nBinop with args: %ld, %ld", UNBOX(p), UNBOX(q));
   switch (op) {
     case ADD:
       ASSERT_UNBOXED("captured +:1", p);
       ASSERT_UNBOXED("captured +:2", q);
 
-      push(BOX(UNBOX(p) + UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) + UNBOX(q));
     case SUB:
       if (UNBOXED(p)) {
         ASSERT_UNBOXED("captured -:2", q);
-        push(BOX(UNBOX(p) - UNBOX(q)));
-        break;
+        return BOX(UNBOX(p) - UNBOX(q));
       }
 
       ASSERT_BOXED("captured -:1", q);
-      push(BOX(p - q));
-      break;
+      return BOX(p - q);
     case MUL:
       ASSERT_UNBOXED("captured *:1", p);
       ASSERT_UNBOXED("captured *:2", q);
 
-      push(BOX(UNBOX(p) * UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) * UNBOX(q));
     case DIV:
       ASSERT_UNBOXED("captured /:1", p);
       ASSERT_UNBOXED("captured /:2", q);
       if (q == 0) {
         failure("Division by zero\n");
       }
-      push(BOX(UNBOX(p) / UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) / UNBOX(q));
     case MOD:
       ASSERT_UNBOXED("captured %:1", p);
       ASSERT_UNBOXED("captured %:2", q);
 
-      push(BOX(UNBOX(p) % UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) % UNBOX(q));
     case LT:
       ASSERT_UNBOXED("captured <:1", p);
       ASSERT_UNBOXED("captured <:2", q);
 
-      push(BOX(UNBOX(p) < UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) < UNBOX(q));
     case LTE:
       ASSERT_UNBOXED("captured <=:1", p);
       ASSERT_UNBOXED("captured <=:2", q);
 
-      push(BOX(UNBOX(p) <= UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) <= UNBOX(q));
     case GT:
       ASSERT_UNBOXED("captured >:1", p);
       ASSERT_UNBOXED("captured >:2", q);
 
-      push(BOX(UNBOX(p) > UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) > UNBOX(q));
     case GTE:
       ASSERT_UNBOXED("captured >=:1", p);
       ASSERT_UNBOXED("captured >=:2", q);
 
-      push(BOX(UNBOX(p) >= UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) >= UNBOX(q));
     case EQ:
-      push(BOX(p == q));
-      break;
+      return BOX(p == q);
     case NEQ:
       ASSERT_UNBOXED("captured !=:1", p);
       ASSERT_UNBOXED("captured !=:2", q);
 
-      push(BOX(UNBOX(p) != UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) != UNBOX(q));
     case AND:
       ASSERT_UNBOXED("captured &&:1", p);
       ASSERT_UNBOXED("captured &&:2", q);
 
-      push(BOX(UNBOX(p) && UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) && UNBOX(q));
     case OR:
       ASSERT_UNBOXED("captured !!:1", p);
       ASSERT_UNBOXED("captured !!:2", q);
 
-      push(BOX(UNBOX(p) || UNBOX(q)));
-      break;
+      return BOX(UNBOX(p) || UNBOX(q));
     default:
       failure("Unknown binop %d\n", op);
   }
+  return BOX(0);
+}
+
+inline static void eval_binop(const unsigned char op) {
+  const aint q = pop();
+  const aint p = pop();
+  push(binop(op, p, q));
   DEBUG_LOG("\nBinop res: %ld", UNBOX(*ESP));
 }
+
+#define R(x) (bases[REG_BASE(x)][REG_OFFSET(x)])
+
+/* Returns the captured variables of the closure the function of the frame was called with */
+static aint * frame_env(const control_frame *c) {
+  return (aint *) TO_DATA(c->ebp[c->begin->args_num])->contents + 1;
+}
+
+// The collector moves closures, so the captured variables of every frame are found again after a collection
+#define REFRESH_ENV() do {                                         \
+    if (gc_stats.collections != collections) {                     \
+      collections = gc_stats.collections;                          \
+      for (control_frame *c = control; c <= ctl; c++) {            \
+        if (c->begin->closure_vars > 0) c->env = frame_env(c);     \
+      }                                                            \
+      bases[REG_CLOSURE] = ctl->env;                               \
+    }                                                              \
+  } while (0)
+
+// Stores what the collector needs to walk the stack: the frames, the instruction with its stack map and the stack top
+#define GC_POINT(i) (state.ctl = ctl, state.pc = (i), __gc_stack_top = (size_t) (ebp + (i)->sp - 1))
+
+// Pushes the frame of a call, its arguments are on top of the value stack
+#define ENTER(i, target) do {                                      \
+    if (ctl == control_end) {                                      \
+      failure("Stack overflow at offset 0x%.8x\n", (i)->offset);   \
+    }                                                              \
+    ctl++;                                                         \
+    ctl->ebp = ebp = ebp + (i)->sp;                                \
+    ctl->ret = (i);                                                \
+    bases[0] = ebp;                                                \
+    pc = insns + (target);                                         \
+  } while (0)
+
+void interpret_registers(const bytefile *bf, const reg_program *rp) {
+  state.bf = bf;
+  state.maps = NULL;
+  state.rp = rp;
+  if (control_stack == NULL) {
+    control_stack = calloc(CONTROL_STACK_SIZE, sizeof(control_frame));
+    if (control_stack == NULL) {
+      failure("Failed to allocate the control stack\n");
+    }
+  }
+  control_frame *const control = control_stack;
+  control_frame *const control_end = control + CONTROL_STACK_SIZE - 1;
+  control_frame *ctl = control;
+  ctl->ebp = bf->stack_ptr;
+  state.control = control;
+  state.ctl = ctl;
+  gc_scan_stack_hook = scan_register_stack;
+  set_static_area(rp->statics, rp->statics + rp->statics_size);
+
+  const reg_insn *const insns = rp->insns;
+  const aint *const stack_limit = bf->stack_ptr - STACK_SIZE;
+  aint *ebp = bf->stack_ptr;
+  aint *bases[4] = {ebp, bf->global_ptr, rp->consts, NULL};
+  size_t collections = gc_stats.collections;
+  const bool counting = count_instructions;
+  const reg_insn *pc = insns + rp->entry;
+  while (1) {
+    const reg_insn *i = pc++;
+    if (counting) {
+      executed_instructions++;
+    }
+    switch (i->op) {
+      case R_MOVE:
+        R(i->dst) = R(i->a);
+        break;
+
+      case R_BINOP:
+        R(i->dst) = binop(i->sub, R(i->a), R(i->b));
+        break;
+
+      case R_ADD: R(i->dst) = BOX(UNBOX(R(i->a)) + UNBOX(R(i->b))); break;
+      case R_SUB: R(i->dst) = BOX(UNBOX(R(i->a)) - UNBOX(R(i->b))); break;
+      case R_MUL: R(i->dst) = BOX(UNBOX(R(i->a)) * UNBOX(R(i->b))); break;
+      case R_DIV:
+      case R_MOD: {
+        const aint q = UNBOX(R(i->b));
+        if (q == 0) {
+          failure("Division by zero\n");
+        }
+        R(i->dst) = BOX(i->op == R_DIV ? UNBOX(R(i->a)) / q : UNBOX(R(i->a)) % q);
+        break;
+      }
+      case R_LT: R(i->dst) = BOX(UNBOX(R(i->a)) < UNBOX(R(i->b))); break;
+      case R_LE: R(i->dst) = BOX(UNBOX(R(i->a)) <= UNBOX(R(i->b))); break;
+      case R_GT: R(i->dst) = BOX(UNBOX(R(i->a)) > UNBOX(R(i->b))); break;
+      case R_GE: R(i->dst) = BOX(UNBOX(R(i->a)) >= UNBOX(R(i->b))); break;
+      case R_EQ: R(i->dst) = BOX(R(i->a) == R(i->b)); break;
+      case R_NE: R(i->dst) = BOX(R(i->a) != R(i->b)); break;
+      case R_AND: R(i->dst) = BOX(UNBOX(R(i->a)) && UNBOX(R(i->b))); break;
+      case R_OR: R(i->dst) = BOX(UNBOX(R(i->a)) || UNBOX(R(i->b))); break;
+
+      case R_JMP:
+        pc = insns + i->target;
+        break;
+
+      case R_JZ:
+        if (UNBOX(R(i->a)) == 0) pc = insns + i->target;
+        break;
+
+      case R_JNZ:
+        if (UNBOX(R(i->a)) != 0) pc = insns + i->target;
+        break;
+
+      case R_SWAP: {
+        const aint a = R(i->a);
+        R(i->a) = R(i->b);
+        R(i->b) = a;
+        break;
+      }
+
+      case R_ELEM:
+        R(i->dst) = (aint) Belem((void *) R(i->a), R(i->b));
+        break;
+
+      case R_STA:
+        R(i->dst) = (aint) Bsta((void *) R(i->a), R(i->b), (void *) R(i->c));
+        break;
+
+      case R_STC:
+        gc_write_barrier(&R(i->dst), (void *) R(i->a));
+        R(i->dst) = R(i->a);
+        break;
+
+      case R_TAG:
+        R(i->dst) = Btag((void *) R(i->a), i->hash, BOX(i->imm));
+        break;
+
+      case R_ARRAY:
+        R(i->dst) = Barray_patt((void *) R(i->a), BOX(i->imm));
+        break;
+
+      case R_PATT: {
+        void *a = (void *) R(i->a);
+        aint result;
+        switch (i->sub) {
+          case PATT_STR_EQ: result = Bstring_patt(a, (void *) R(i->b)); break;
+          case PATT_STRING: result = Bstring_tag_patt(a); break;
+          case PATT_ARRAY: result = Barray_tag_patt(a); break;
+          case PATT_SEXP: result = Bsexp_tag_patt(a); break;
+          case PATT_BOXED: result = Bboxed_patt(a); break;
+          case PATT_UNBOXED: result = Bunboxed_patt(a); break;
+          case PATT_CLOSURE: result = Bclosure_tag_patt(a); break;
+          default: failure("ERROR: invalid pattern %d\n", i->sub);
+        }
+        R(i->dst) = result;
+        break;
+      }
+
+      case R_LREAD:
+        R(i->dst) = Lread();
+        break;
+
+      case R_LWRITE:
+        R(i->dst) = BOX(Lwrite(R(i->a)));
+        break;
+
+      case R_LLENGTH:
+        R(i->dst) = Llength((void *) R(i->a));
+        break;
+
+      case R_BEGIN:
+        if (ebp - i->imm <= stack_limit) {
+          failure("Stack overflow at offset 0x%.8x\n", i->offset);
+        }
+        ctl->begin = i;
+        // The closure is checked once, its captured variables are then accessed as directly as locals
+        ctl->env = NULL;
+        if (i->closure_vars > 0) {
+          ctl->env = closure_field(ebp[i->args_num], i->closure_vars - 1) - (i->closure_vars - 1);
+        }
+        bases[REG_CLOSURE] = ctl->env;
+        // Fields of replaced objects are scanned with the operands, their slots are cleared with the locals
+        for (aint *local = ebp - 1, *end = ebp - 1 - i->locals_num - i->fields_num; local > end; local--) {
+          *local = EMPTY;
+        }
+        break;
+
+      case R_RET: {
+        if (ctl == control) goto stop; // Exiting the main function
+        const aint return_value = R(i->a);
+        const reg_insn *call = ctl->ret;
+        ctl--;
+        ebp = ctl->ebp;
+        bases[REG_FRAME] = ebp;
+        bases[REG_CLOSURE] = ctl->env;
+        R(call->dst) = return_value;
+        pc = call + 1;
+        break;
+      }
+
+      case R_FAIL:
+        failure("Lama failure at (%d, %d)\n", i->imm, i->target);
+
+      case R_ABORT:
+        failure("Should not happen. Indirect assignments are temporarily prohibited.\n");
+
+      case R_STRING: {
+        const char *s = i->str;
+        GC_POINT(i);
+        R(i->dst) = (aint) Bstring((aint *) &s);
+        REFRESH_ENV();
+        break;
+      }
+
+      case R_SEXP: {
+        aint *top = ebp + i->sp;
+        *top = i->hash;
+        GC_POINT(i);
+        R(i->dst) = (aint) Bsexp_reversed(top, BOX(i->imm + 1));
+        REFRESH_ENV();
+        break;
+      }
+
+      case R_CLOSURE: {
+        aint *args = ebp + i->sp - i->imm - 1;
+        args[0] = i->target;
+        for (int k = 0; k < i->imm; k++) {
+          args[k + 1] = R(i->captures[k]);
+        }
+        GC_POINT(i);
+        R(i->dst) = (aint) Bclosure(args, BOX(i->imm));
+        REFRESH_ENV();
+        break;
+      }
+
+      case R_LSTRING:
+        GC_POINT(i);
+        R(i->dst) = (aint) Lstring(ebp + i->sp);
+        REFRESH_ENV();
+        break;
+
+      case R_BARRAY:
+        GC_POINT(i);
+        R(i->dst) = (aint) Barray_reversed(ebp + i->sp, BOX(i->imm));
+        REFRESH_ENV();
+        break;
+
+      case R_CALL:
+        ENTER(i, i->target);
+        break;
+
+      case R_CALLC: {
+        const aint closure_ptr = *(ebp + i->sp + i->imm);
+        const data *closure = safe_retrieve_closure(closure_ptr);
+        const aint offset = ((aint *) closure->contents)[0];
+        if (offset < 0 || offset >= rp->code_size || rp->entry_of[offset] < 0) {
+          failure("Closure entry 0x%.8x is not a function\n", offset);
+        }
+        ENTER(i, rp->entry_of[offset]);
+        break;
+      }
+
+      default:
+        failure("ERROR: invalid register instruction %d\n", i->op);
+    }
+  }
+stop:
+  gc_scan_stack_hook = NULL;
+  set_static_area(NULL, NULL);
+  fprintf(OUTPUT, "<done>\n");
+}
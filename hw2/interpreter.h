@@ -6,6 +6,7 @@
 #define HW2_INTERPRETER_H
 
 #include "runtime_common.h"
+#include <stdbool.h>
 #include <stdio.h>
 
 #define STACK_SIZE 1048576
@@ -32,10 +33,36 @@ typedef struct {
 
 const bytefile *read_file(const char *fname);
 
+/* Reads the per-offset execution counts written by `hw2 --profile` for the file */
+unsigned long long *read_profile(const char *fname, const bytefile *bf);
+
+void dump_header(FILE *f, const bytefile *bf);
+
 void dump_file(FILE *f, const bytefile *bf);
 
+const char *get_public_name(const bytefile *f, unsigned int i);
+
+int get_public_offset(const bytefile *f, unsigned int i);
+
 const char *get_string(const bytefile *f, unsigned int pos);
 
-void interpret(const bytefile *bf);
+typedef struct stack_maps stack_maps;
+typedef struct reg_program reg_program;
+
+// Runs main; with stack maps the collector marks only the live slots of every frame, otherwise it scans the
+// whole stack conservatively
+void interpret(const bytefile *bf, const stack_maps *maps);
+
+// Runs main translated into the register IR, the stack maps are taken from its instructions
+void interpret_registers(const bytefile *bf, const reg_program *rp);
+
+// Whether interpret() and interpret_registers() count the instructions they dispatch, which only --stats reports
+extern _Thread_local bool count_instructions;
+
+// Number of instructions dispatched by interpret() or interpret_registers() while count_instructions is set
+extern _Thread_local unsigned long long executed_instructions;
+
+// Per-offset execution counts collected when not NULL, indexed by the code offset of the opcode
+extern _Thread_local unsigned long long *instruction_counts;
 
 #endif //HW2_INTERPRETER_H
\ No newline at end of file
@@ -0,0 +1,93 @@
+//
+// Multi-threaded job service, see jobs.h
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "jobs.h"
+#include "server.h"
+#include "gc.h"
+#include "replay.h"
+#include "runtime.h"
+
+typedef struct {
+  int listener;
+  job_function run;
+} job_pool;
+
+/* Runs the job of the connection in the calling thread and closes the connection */
+static void run_job(const int conn, const job_function run) {
+  FILE *const input = fdopen(conn, "r");
+  const int output_fd = input == NULL ? -1 : dup(conn);
+  FILE *const output = output_fd < 0 ? NULL : fdopen(output_fd, "w");
+  if (output == NULL) {
+    fprintf(stderr, "Failed to open the streams of a job: %s\n", strerror(errno));
+    if (output_fd >= 0) close(output_fd);
+    if (input != NULL) fclose(input); else close(conn);
+    return;
+  }
+  char *path = NULL;
+  size_t capacity = 0;
+  ssize_t length = getline(&path, &capacity, input);
+  if (length < 0) length = 0;
+  while (length > 0 && (path[length - 1] == '\n' || path[length - 1] == '\r')) length--;
+  if (path != NULL) path[length] = '\0';
+
+  set_runtime_streams(input, output);
+  jmp_buf handler;
+  if (setjmp(handler) == 0) {
+    set_failure_handler(&handler);
+    run(path != NULL ? path : "", output);
+  } else {
+    // The failure is already reported to the job, a log it was recording is closed with the heap
+    replay_finish();
+  }
+  set_failure_handler(NULL);
+  // The heap stays reserved for the next job of the thread
+  gc_reset();
+  set_runtime_streams(NULL, NULL);
+
+  free(path);
+  fclose(output);
+  fclose(input);
+}
+
+static void *work(void *arg) {
+  const job_pool *const pool = arg;
+  gc_init_thread();
+  while (1) {
+    const int conn = accept(pool->listener, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      failure("Failed to accept a job: %s\n", strerror(errno));
+    }
+    run_job(conn, pool->run);
+  }
+}
+
+_Noreturn void serve_jobs(const char *socket_path, const int threads, const job_function run) {
+  // A client that goes away must not take the process down, the writes of its job just fail
+  signal(SIGPIPE, SIG_IGN);
+  static job_pool pool;
+  pool = (job_pool) {listen_on(socket_path), run};
+  for (int k = 1; k < threads; k++) {
+    pthread_t thread;
+    const int error = pthread_create(&thread, NULL, work, &pool);
+    if (error != 0) {
+      failure("Failed to start a thread: %s\n", strerror(error));
+    }
+    pthread_detach(thread);
+  }
+  fprintf(stderr, "Serving jobs on %s with %d threads\n", socket_path, threads);
+  // The main thread is one of the pool
+  work(&pool);
+  exit(0);
+}
@@ -0,0 +1,23 @@
+//
+// Job service: a fixed pool of threads in a single process runs the jobs sent
+// over a local Unix socket, no process is created per job.
+//
+// A job starts with a line with the path of a bytecode file, the rest of the
+// connection is the input of the program, its output is streamed back until
+// the thread closes the connection. Every thread has its own interpreter
+// state, heap and Lama stack, the loaded code is shared by all of them.
+//
+
+#ifndef HW2_JOBS_H
+#define HW2_JOBS_H
+
+#include <stdio.h>
+
+// Runs the file in the calling thread, the runtime streams are already the connection and the heap is ready. Every
+// thread sets up its heap once and empties it after each job, gc_init_process has to be called before
+typedef void (*job_function)(const char *path, FILE *output);
+
+/* Listens on the socket and runs the jobs on the given number of threads, never returns */
+_Noreturn void serve_jobs(const char *socket_path, int threads, job_function run);
+
+#endif //HW2_JOBS_H
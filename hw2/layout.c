@@ -0,0 +1,211 @@
+//
+// Profile-guided block layout of the register IR
+//
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+#include "runtime.h"
+
+typedef struct {
+  int begin, end;               // Instructions [begin, end) of the program
+  int function;                 // Index of the function it belongs to, in the order of their BEGIN instructions
+  int entry;                    // First block of the function
+  int next;                     // Block the control falls through to unless the last instruction jumps, -1 if none
+  int target;                   // Block the jump at the end goes to, -1 if none
+  unsigned long long count;     // Executions of its first instruction in the training run
+  int chain;                    // First block of the chain it is laid out in
+  int after;                    // Block laid out right after it in the chain, -1 if it is the last one
+} block;
+
+// A control flow edge. The profile counts blocks, an edge is taken at most as often as its ends are executed
+typedef struct {
+  int from, to;
+  unsigned long long weight;
+  bool fallthrough;
+} edge;
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static bool is_jump(const reg_insn *i) {
+  return i->op == R_JMP || i->op == R_JZ || i->op == R_JNZ;
+}
+
+static bool falls_through(const reg_insn *i) {
+  return i->op != R_JMP && i->op != R_RET && i->op != R_FAIL;
+}
+
+static int compare_edges(const void *a, const void *b) {
+  const edge *x = a, *y = b;
+  if (x->weight != y->weight) return x->weight < y->weight ? 1 : -1;
+  if (x->fallthrough != y->fallthrough) return x->fallthrough ? -1 : 1;
+  return x->from - y->from;
+}
+
+static unsigned long long min_count(const block *a, const block *b) {
+  return a->count < b->count ? a->count : b->count;
+}
+
+/* Links blocks into chains along the most frequent edges first: an edge joins the chain ending at its source with
+   the chain starting at its target, so the target falls through from the source. Entries of functions start their
+   chains, edges never executed join nothing */
+static void build_chains(block *blocks, const int blocks_num) {
+  edge *edges = checked_calloc(2 * blocks_num, sizeof(edge));
+  int edges_num = 0;
+  for (int b = 0; b < blocks_num; b++) {
+    blocks[b].chain = b;
+    blocks[b].after = -1;
+    if (blocks[b].next >= 0) {
+      edges[edges_num++] = (edge) {b, blocks[b].next, min_count(&blocks[b], &blocks[blocks[b].next]), true};
+    }
+    if (blocks[b].target >= 0) {
+      edges[edges_num++] = (edge) {b, blocks[b].target, min_count(&blocks[b], &blocks[blocks[b].target]), false};
+    }
+  }
+  qsort(edges, edges_num, sizeof(edge), compare_edges);
+  for (int k = 0; k < edges_num && edges[k].weight > 0; k++) {
+    block *from = &blocks[edges[k].from], *to = &blocks[edges[k].to];
+    if (from->after >= 0 || to->chain != edges[k].to || to->chain == from->chain ||
+        to->function != from->function || to->entry == edges[k].to) {
+      continue;
+    }
+    from->after = edges[k].to;
+    for (int b = edges[k].to; b >= 0; b = blocks[b].after) {
+      blocks[b].chain = from->chain;
+    }
+  }
+  free(edges);
+}
+
+/* Copies the block to the end of the code and ends it with the jumps the block placed after it needs, the targets
+   of jumps are block indices until all blocks are copied */
+static void emit_block(const reg_program *rp, const block *b, const int following, reg_insn *code, int *n, int *moved) {
+  int end = b->end;
+  const reg_insn *last = &rp->insns[end - 1];
+  // A jump to the block placed next is dropped, returning calls land on the instruction that follows it
+  if (last->op == R_JMP && b->target == following) end--;
+  for (int k = b->begin; k < end; k++) {
+    moved[k] = *n;
+    code[(*n)++] = rp->insns[k];
+  }
+  if (end < b->end) {
+    moved[end] = *n;
+  }
+  reg_insn *copy = &code[*n - 1];
+  if (is_jump(last) && end == b->end) {
+    copy->target = b->target;
+  }
+  int fallthrough = b->next;
+  if ((last->op == R_JZ || last->op == R_JNZ) && b->next != following && b->target == following) {
+    // The taken side follows, so the condition is inverted
+    copy->op = last->op == R_JZ ? R_JNZ : R_JZ;
+    copy->target = b->next;
+    fallthrough = following;
+  }
+  if (falls_through(last) && fallthrough >= 0 && fallthrough != following) {
+    reg_insn *jump = &code[(*n)++];
+    memset(jump, 0, sizeof(reg_insn));
+    jump->op = R_JMP;
+    jump->target = fallthrough;
+    jump->offset = last->offset;
+  }
+}
+
+void layout_blocks(reg_program *rp, const unsigned long long *counts) {
+  const int insns_num = rp->insns_num;
+  bool *leader = checked_calloc(insns_num + 1, sizeof(bool));
+  leader[0] = true;
+  for (int k = 0; k < insns_num; k++) {
+    const reg_insn *i = &rp->insns[k];
+    if (i->op == R_BEGIN) leader[k] = true;
+    if (is_jump(i)) leader[i->target] = true;
+    if (is_jump(i) || !falls_through(i)) leader[k + 1] = true;
+  }
+  int blocks_num = 0;
+  for (int k = 0; k < insns_num; k++) {
+    blocks_num += leader[k];
+  }
+  block *blocks = checked_calloc(blocks_num, sizeof(block));
+  int *block_of = checked_calloc(insns_num, sizeof(int));
+  int function = -1, entry = 0;
+  for (int k = 0, b = -1; k < insns_num; k++) {
+    if (leader[k]) {
+      if (rp->insns[k].op == R_BEGIN) {
+        function++;
+        entry = b + 1;
+      }
+      blocks[++b] = (block) {.begin = k, .function = function, .entry = entry, .next = -1, .target = -1};
+      blocks[b].count = counts[rp->insns[k].offset];
+    }
+    blocks[b].end = k + 1;
+    block_of[k] = b;
+  }
+  for (int b = 0; b < blocks_num; b++) {
+    const reg_insn *last = &rp->insns[blocks[b].end - 1];
+    if (is_jump(last)) blocks[b].target = block_of[last->target];
+    if (falls_through(last) && b + 1 < blocks_num) blocks[b].next = b + 1;
+  }
+
+  // The chain of the entry of every function comes first, then its other chains in their original order. The blocks
+  // the training run never executed in a called function form the cold section after all functions, a function it
+  // never called keeps its order and place
+  build_chains(blocks, blocks_num);
+  int *order = checked_calloc(blocks_num, sizeof(int));
+  int placed = 0;
+  for (int first = 0; first < blocks_num; ) {
+    int last = first;
+    while (last < blocks_num && blocks[last].function == blocks[first].function) last++;
+    const bool called = blocks[first].count > 0;
+    for (int head = first; head < last; head++) {
+      if (blocks[head].chain != head || (called && blocks[head].count == 0)) continue;
+      for (int b = head; b >= 0; b = blocks[b].after) {
+        order[placed++] = b;
+      }
+    }
+    first = last;
+  }
+  for (int b = 0; b < blocks_num; b++) {
+    if (blocks[b].chain == b && blocks[b].count == 0 && blocks[blocks[b].entry].count > 0) {
+      order[placed++] = b;
+    }
+  }
+
+  reg_insn *code = checked_calloc(insns_num + blocks_num, sizeof(reg_insn));
+  int *moved = checked_calloc(insns_num, sizeof(int));
+  int *start = checked_calloc(blocks_num, sizeof(int));
+  int n = 0;
+  for (int k = 0; k < blocks_num; k++) {
+    start[order[k]] = n;
+    emit_block(rp, &blocks[order[k]], k + 1 < blocks_num ? order[k + 1] : -1, code, &n, moved);
+  }
+  for (int k = 0; k < n; k++) {
+    if (is_jump(&code[k])) {
+      code[k].target = start[code[k].target];
+    } else if (code[k].op == R_CALL) {
+      code[k].target = moved[code[k].target];
+    }
+  }
+  for (unsigned long offset = 0; offset < rp->code_size; offset++) {
+    if (rp->entry_of[offset] >= 0) rp->entry_of[offset] = moved[rp->entry_of[offset]];
+  }
+  rp->entry = moved[rp->entry];
+  // The captured variables of closures now belong to the copies
+  free(rp->insns);
+  rp->insns = code;
+  rp->insns_num = n;
+
+  free(start);
+  free(moved);
+  free(order);
+  free(block_of);
+  free(blocks);
+  free(leader);
+}
@@ -0,0 +1,18 @@
+//
+// Profile-guided block layout of the register IR. The code of every function
+// is split into basic blocks, which are reordered so that the successor a
+// training run took more often follows its block: the hot path of a loop or
+// a case falls through instead of jumping. Blocks the training run never
+// executed in a function it called (match failures, error paths) are moved to
+// a cold section after all functions.
+//
+
+#ifndef HW2_LAYOUT_H
+#define HW2_LAYOUT_H
+
+#include "regir.h"
+
+/* Reorders the blocks by the per-offset execution counts of a profile of the code the program was translated from */
+void layout_blocks(reg_program *rp, const unsigned long long *counts);
+
+#endif //HW2_LAYOUT_H
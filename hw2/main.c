@@ -4,40 +4,388 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
 
 #include "gc.h"
 #include "interpreter.h"
+#include "analysis.h"
+#include "optimizer.h"
+#include "stackmap.h"
+#include "regir.h"
+#include "layout.h"
+#include "replay.h"
+#include "server.h"
+#include "jobs.h"
 #include "./runtime/runtime.h"
 
 #include <dirent.h>
+#include <pthread.h>
 #include <unistd.h>
 
-static void interpret_file(const char * filename) {
+static const char *stats_file = NULL;
+static const char *profile_file = NULL;
+static const char *layout_file = NULL;
+static int optimization = 1;
+static int stack_machine = 0;
+static replay_mode replay = REPLAY_OFF;
+static const char *replay_file = NULL;
+static unsigned int seed;
+static int seed_given = 0;
+static const char *socket_path = NULL;
+static int workers = 4;
+static const char *jobs_socket_path = NULL;
+static int threads = 4;
+
+static void write_stats(void) {
+  FILE *f = fopen(stats_file, "w");
+  if (f == NULL) {
+    failure("Failed to open stats file %s: %s\n", stats_file, strerror(errno));
+  }
+  fprintf(f, "instructions %llu\n", executed_instructions);
+  fprintf(f, "gc_count %zu\n", gc_stats.collections);
+  fprintf(f, "gc_major_count %zu\n", gc_stats.major_collections);
+  fprintf(f, "gc_time_ms %.3f\n", gc_stats.time * 1000);
+  fclose(f);
+}
+
+/* Writes "offset count" lines for every executed instruction, the format hw2-dis --profile reads */
+static void write_profile(const bytefile *bf) {
+  FILE *f = fopen(profile_file, "w");
+  if (f == NULL) {
+    failure("Failed to open profile file %s: %s\n", profile_file, strerror(errno));
+  }
+  for (unsigned long i = 0; i < bf->code_size; i++) {
+    if (instruction_counts[i] != 0) {
+      fprintf(f, "0x%.8lx %llu\n", i, instruction_counts[i]);
+    }
+  }
+  fclose(f);
+}
+
+// A bytecode file ready to run: everything that does not depend on the input is done once
+typedef struct {
+  const bytefile *bf;
+  stack_maps *maps;
+  reg_program *rp;              // NULL when the stack machine runs the file
+} prepared_file;
+
+static prepared_file prepare_file(const char * filename) {
   const bytefile *f = read_file(filename);
-  dump_file(stdout, f);
-  fprintf(stdout, "\n");
-  __gc_init();
+  // A training profile for the block layout counts the instructions of the original code, it follows them through
+  // the optimizer
+  unsigned long long *counts = layout_file != NULL ? read_profile(layout_file, f) : NULL;
+  // Profiles refer to the offsets of the original code, so that hw2-dis can show them
+  if (optimization && profile_file == NULL) {
+    optimize((bytefile *) f, counts);
+  }
+  program *p = analyze_program(f);
+  stack_maps *maps = build_stack_maps(p);
+  // Profiles count bytecode instructions, only the stack machine executes them one by one
+  reg_program *rp = stack_machine || profile_file != NULL ? NULL : translate_program(p, maps);
+  if (rp != NULL && counts != NULL) {
+    layout_blocks(rp, counts);
+  }
+  free(counts);
+  free_program(p);
+  return (prepared_file) {f, maps, rp};
+}
+
+/* Runs the prepared file on the stack and globals of f, which are those of pf->bf unless a job has its own */
+static void run_file(const prepared_file *pf, const bytefile *f, const unsigned int run_seed) {
+  replay_init(replay, replay_file, run_seed);
   __gc_stack_bottom = (size_t) (f->global_ptr + f->global_area_size + 1);
   __gc_stack_top = (size_t) (f->stack_ptr - 1);
-  interpret(f);
+  if (pf->rp != NULL) {
+    interpret_registers(f, pf->rp);
+  } else {
+    interpret(f, pf->maps);
+  }
+  replay_finish();
+}
+
+static void interpret_file(const char * filename) {
+  const prepared_file pf = prepare_file(filename);
+  const bytefile *f = pf.bf;
+  if (profile_file != NULL) {
+    instruction_counts = calloc(f->code_size, sizeof(unsigned long long));
+    if (instruction_counts == NULL) {
+      failure("Failed to allocate the profile\n");
+    }
+  }
+  __gc_init();
+  run_file(&pf, f, seed);
+  if (pf.rp != NULL) {
+    free_reg_program(pf.rp);
+  }
+  free_stack_maps(pf.maps);
+  if (profile_file != NULL) {
+    write_profile(f);
+    free(instruction_counts);
+  }
   free((bytefile *) f);
 }
 
+static char **served_names;
+static prepared_file *served_files;
+
+/* Runs a request of the server in its worker process */
+static void serve_file(const int file) {
+  // Requests without an explicit seed must not share the random sequence of the worker they were forked from
+  if (!seed_given) {
+    seed = (unsigned int) time(NULL) ^ (unsigned int) getpid();
+  }
+  printf("Interpreting %s\n", served_names[file]);
+  run_file(&served_files[file], served_files[file].bf, seed);
+}
+
+/* Prepares the files and the heap once, the workers forked for the requests start from this state */
+static _Noreturn void serve_files(const char *socket_path, const int files_num, char **names) {
+  served_names = names;
+  served_files = calloc(files_num, sizeof(prepared_file));
+  if (served_files == NULL) {
+    failure("Failed to allocate the files\n");
+  }
+  for (int k = 0; k < files_num; k++) {
+    served_files[k] = prepare_file(names[k]);
+  }
+  __gc_init();
+  serve(socket_path, workers, files_num, names, serve_file);
+}
+
+// A file loaded by the jobs, shared by all threads of the service
+typedef struct loaded_file {
+  char *path;
+  prepared_file pf;
+  struct loaded_file *next;
+} loaded_file;
+
+static loaded_file *loaded_files;
+static pthread_mutex_t loaded_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Lama stack and globals of the jobs of the thread, grown to the largest global area seen
+static _Thread_local aint *job_stack;
+static _Thread_local size_t job_stack_words;
+
+static const prepared_file *find_loaded_file(const char *path) {
+  pthread_mutex_lock(&loaded_files_lock);
+  const loaded_file *l = loaded_files;
+  while (l != NULL && strcmp(l->path, path) != 0) {
+    l = l->next;
+  }
+  pthread_mutex_unlock(&loaded_files_lock);
+  return l == NULL ? NULL : &l->pf;
+}
+
+/* Prepares the file once, a failure while loading it leaves nothing behind but the failure of the job */
+static const prepared_file *load_file(const char *path) {
+  const prepared_file *pf = find_loaded_file(path);
+  if (pf != NULL) {
+    return pf;
+  }
+  // Loading is done outside of the lock, two threads that load the same file at once both keep theirs
+  const prepared_file loaded = prepare_file(path);
+  loaded_file *l = malloc(sizeof(loaded_file));
+  char *copy = strdup(path);
+  if (l == NULL || copy == NULL) {
+    failure("Failed to allocate the file\n");
+  }
+  *l = (loaded_file) {copy, loaded, NULL};
+  pthread_mutex_lock(&loaded_files_lock);
+  l->next = loaded_files;
+  loaded_files = l;
+  pthread_mutex_unlock(&loaded_files_lock);
+  return &l->pf;
+}
+
+/* Runs a job of the service in the calling thread on its own stack and globals */
+static void run_job(const char *path, FILE *output) {
+  const prepared_file *pf = load_file(path);
+  const size_t words = STACK_SIZE + pf->bf->global_area_size + 1;
+  if (job_stack_words < words) {
+    free(job_stack);
+    job_stack = malloc(words * sizeof(aint));
+    if (job_stack == NULL) {
+      job_stack_words = 0;
+      failure("Failed to allocate the stack\n");
+    }
+    job_stack_words = words;
+  }
+  // The loaded code is shared, only the pointers to the stack and the globals differ
+  bytefile f = *pf->bf;
+  f.global_ptr = &job_stack[STACK_SIZE];
+  f.stack_ptr = &job_stack[STACK_SIZE];
+  memset(f.global_ptr, 0, (f.global_area_size + 1) * sizeof(aint));
+  unsigned int run_seed = seed;
+  if (!seed_given) {
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    run_seed = (unsigned int) t.tv_sec ^ (unsigned int) t.tv_nsec;
+  }
+  fprintf(output, "Interpreting %s\n", path);
+  run_file(pf, &f, run_seed);
+}
+
+/* Loads the given files ahead of the first jobs and serves the jobs */
+static _Noreturn void serve_jobs_of(const char *socket_path, const int files_num, char **names) {
+  for (int k = 0; k < files_num; k++) {
+    load_file(names[k]);
+  }
+  serve_jobs(socket_path, threads, run_job);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [--stats FILE] [--profile FILE | --layout FILE] [--no-optimize] [--stack-vm] [--record LOG | --replay LOG] [--seed N] [HEAP] <file.bc> [input]\n", name);
+  fprintf(stderr, "       %s --serve SOCKET [--workers N] [--layout FILE] [--no-optimize] [--stack-vm] [--seed N] <file.bc>...\n", name);
+  fprintf(stderr, "       %s --jobs SOCKET [--threads N] [--no-optimize] [--stack-vm] [--seed N] [HEAP] [<file.bc>...]\n", name);
+  fprintf(stderr, "HEAP:  [--heap-initial SIZE] [--heap-max SIZE] [--gc-time-ratio R] [--gc-threads N], SIZE in bytes with an\n");
+  fprintf(stderr, "       optional K, M or G suffix, R between 0 and 1, N mark threads up to %d. The defaults come from\n", MAX_MARK_THREADS);
+  fprintf(stderr, "       LAMA_HEAP_INITIAL, LAMA_HEAP_MAX, LAMA_GC_TIME_RATIO and LAMA_GC_THREADS\n");
+  exit(1);
+}
+
 int main(const int argc, char *argv[]) {
+  static const struct option options[] = {
+    {"stats", required_argument, NULL, 's'},
+    {"profile", required_argument, NULL, 'o'},
+    {"layout", required_argument, NULL, 'l'},
+    {"no-optimize", no_argument, &optimization, 0},
+    {"stack-vm", no_argument, &stack_machine, 1},
+    {"record", required_argument, NULL, 'r'},
+    {"replay", required_argument, NULL, 'p'},
+    {"seed", required_argument, NULL, 'e'},
+    {"serve", required_argument, NULL, 'v'},
+    {"workers", required_argument, NULL, 'w'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"threads", required_argument, NULL, 't'},
+    {"heap-initial", required_argument, NULL, 'i'},
+    {"heap-max", required_argument, NULL, 'm'},
+    {"gc-time-ratio", required_argument, NULL, 'g'},
+    {"gc-threads", required_argument, NULL, 'c'},
+    {NULL, 0, NULL, 0}
+  };
+  if (!gc_configure_from_environment()) {
+    usage(argv[0]);
+  }
+  seed = (unsigned int) time(NULL);
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    switch (opt) {
+      case 's':
+        stats_file = optarg;
+        break;
+      case 'o':
+        profile_file = optarg;
+        break;
+      case 'l':
+        layout_file = optarg;
+        break;
+      case 0:
+        break;
+      case 'r':
+      case 'p':
+        if (replay != REPLAY_OFF) {
+          usage(argv[0]);
+        }
+        replay = opt == 'r' ? REPLAY_RECORD : REPLAY_REPLAY;
+        replay_file = optarg;
+        break;
+      case 'e':
+        seed = (unsigned int) strtoul(optarg, NULL, 10);
+        seed_given = 1;
+        break;
+      case 'v':
+        socket_path = optarg;
+        break;
+      case 'w':
+        workers = atoi(optarg);
+        if (workers <= 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'j':
+        jobs_socket_path = optarg;
+        break;
+      case 't':
+        threads = atoi(optarg);
+        if (threads <= 0) {
+          usage(argv[0]);
+        }
+        break;
+      case 'i':
+      case 'm': {
+        const size_t words = gc_parse_size(optarg);
+        if (words == 0) {
+          usage(argv[0]);
+        }
+        *(opt == 'i' ? &gc_config.initial_heap_size : &gc_config.max_heap_size) = words;
+        break;
+      }
+      case 'g': {
+        char *end;
+        gc_config.gc_time_ratio = strtod(optarg, &end);
+        if (*end != '\0' || !(gc_config.gc_time_ratio > 0 && gc_config.gc_time_ratio < 1)) {
+          usage(argv[0]);
+        }
+        break;
+      }
+      case 'c':
+        gc_config.mark_threads = atoi(optarg);
+        if (gc_config.mark_threads <= 0 || gc_config.mark_threads > MAX_MARK_THREADS) {
+          usage(argv[0]);
+        }
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  // The limit counts the nursery, and the old generation needs room to promote a full one before anything can run
+  if (gc_config.max_heap_size < MIN_HEAP_SIZE) {
+    failure("the heap limit of %zu bytes is below the smallest heap of %zu bytes: the nursery and room to promote it\n",
+            WORDS_TO_BYTES(gc_config.max_heap_size),
+            WORDS_TO_BYTES((size_t)MIN_HEAP_SIZE));
+  }
+  gc_config.initial_heap_size = MIN(gc_config.initial_heap_size, gc_config.max_heap_size);
+  // Jobs name their files, the ones given are only loaded in advance
+  if (optind >= argc && jobs_socket_path == NULL) {
+    usage(argv[0]);
+  }
+  // A layout profile is of a single file, and it is taken by the stack machine with --profile
+  if (layout_file != NULL &&
+      (profile_file != NULL || jobs_socket_path != NULL || (socket_path != NULL && argc - optind != 1))) {
+    usage(argv[0]);
+  }
   if (sizeof(aint) != sizeof(size_t)) {
     perror("ERROR: adaptive int has wrong size\n");
     exit(1);
   }
-  printf("Interpreting %s\n", argv[1]);
-  if (argc > 2) {
+  if (socket_path != NULL || jobs_socket_path != NULL) {
+    // Statistics, profiles and logs are written per run, which a server does not have
+    if (stats_file != NULL || profile_file != NULL || replay != REPLAY_OFF
+        || (socket_path != NULL && jobs_socket_path != NULL)) {
+      usage(argv[0]);
+    }
+    if (jobs_socket_path != NULL) {
+      // The threads of the service only set up their heaps
+      gc_init_process();
+      serve_jobs_of(jobs_socket_path, argc - optind, argv + optind);
+    }
+    serve_files(socket_path, argc - optind, argv + optind);
+  }
+  count_instructions = stats_file != NULL;
+  printf("Interpreting %s\n", argv[optind]);
+  if (argc > optind + 1) {
     // Redirect stdin to the input file
-    if (freopen(argv[2], "r", stdin) == NULL) {
+    if (freopen(argv[optind + 1], "r", stdin) == NULL) {
       perror("Failed to redirect stdin");
       exit(1);
     }
 
     setbuf(stdin, NULL);
   }
-  interpret_file(argv[1]);
+  interpret_file(argv[optind]);
+  if (stats_file != NULL) {
+    write_stats();
+  }
   return 0;
 }
@@ -0,0 +1,208 @@
+//
+// Load-time bytecode optimizer
+//
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimizer.h"
+#include "analysis.h"
+#include "runtime.h"
+
+// Every round works on the output of the previous one: folding a branch may leave dead code or new patterns
+#define MAX_ROUNDS 4
+#define MAX_JUMP_CHAIN 16
+
+// Immediates of CONST are 32-bit, folded values must fit them
+#define FITS_CONST(x) ((x) >= INT32_MIN && (x) <= INT32_MAX)
+
+typedef struct {
+  instruction insn;             // Jump, call and closure targets are original offsets until encoding
+  bool target;                  // Control may enter the instruction from somewhere except the previous one
+} item;
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static bool is(const instruction *i, const unsigned char h, const unsigned char l) {
+  return i->h == h && i->l == l;
+}
+
+static bool is_const(const item *it) {
+  return is(&it->insn, CONST, CONST_INT);
+}
+
+/* Follows chains of unconditional jumps and returns the final target offset */
+static int thread_jump(const program *p, int target) {
+  for (int hops = 0; hops < MAX_JUMP_CHAIN; hops++) {
+    const instruction *t = &p->insns[p->index[target]];
+    if (!is(t, CONST, JMP) || t->args[0] == target) break;
+    target = t->args[0];
+  }
+  return target;
+}
+
+/* Computes a BINOP over constants the same way eval_binop does, fails if the result depends on the runtime */
+static bool fold_binop(const unsigned char l, const long long a, const long long b, long long *result) {
+  switch (l) {
+    case 1: *result = a + b; break;
+    case 2: *result = a - b; break;
+    case 3: *result = a * b; break;
+    case 4: if (b == 0) return false; *result = a / b; break;
+    case 5: if (b == 0) return false; *result = a % b; break;
+    case 6: *result = a < b; break;
+    case 7: *result = a <= b; break;
+    case 8: *result = a > b; break;
+    case 9: *result = a >= b; break;
+    case 10: *result = a == b; break;
+    case 11: *result = a != b; break;
+    case 12: *result = a && b; break;
+    case 13: *result = a || b; break;
+    default: return false;
+  }
+  return FITS_CONST(*result);
+}
+
+/* Simplifies the tail of the output once, returns false if no pattern matched. Only the first instruction of
+   a pattern may be a jump target, the others are always entered from their predecessor */
+static bool reduce(item *out, int *n) {
+  if (*n >= 3 && is_const(&out[*n - 3]) && is_const(&out[*n - 2]) && out[*n - 1].insn.h == BINOP &&
+      !out[*n - 2].target && !out[*n - 1].target) {
+    long long result;
+    if (fold_binop(out[*n - 1].insn.l, out[*n - 3].insn.args[0], out[*n - 2].insn.args[0], &result)) {
+      out[*n - 3].insn.args[0] = (int) result;
+      *n -= 2;
+      return true;
+    }
+  }
+  if (*n < 2 || out[*n - 1].target) return false;
+  item *a = &out[*n - 2], *b = &out[*n - 1];
+
+  // CONST c; CJMPz/CJMPnz -> JMP or nothing
+  if (is_const(a) && b->insn.h == CONTROL && (b->insn.l == CJMPz || b->insn.l == CJMPnz)) {
+    if ((a->insn.args[0] == 0) == (b->insn.l == CJMPz)) {
+      a->insn = b->insn;
+      a->insn.h = CONST;
+      a->insn.l = JMP;
+      *n -= 1;
+    } else {
+      *n -= 2;
+    }
+    return true;
+  }
+  // Pushing a value and dropping it at once
+  if (is(&b->insn, CONST, DROP) &&
+      (is(&a->insn, CONST, DUP) || is_const(a) || a->insn.h == LD)) {
+    *n -= 2;
+    return true;
+  }
+  if (is(&a->insn, CONST, SWAP) && is(&b->insn, CONST, SWAP)) {
+    *n -= 2;
+    return true;
+  }
+  // Only the last line of a run is observable
+  if (is(&a->insn, CONTROL, LINE) && is(&b->insn, CONTROL, LINE)) {
+    a->insn.args[0] = b->insn.args[0];
+    *n -= 1;
+    return true;
+  }
+  return false;
+}
+
+/* Runs one round over the program and writes the result into the code section, returns the new code size */
+static unsigned long optimize_round(bytefile *bf, unsigned long long *counts) {
+  program *p = analyze_program(bf);
+  bool *targets = checked_calloc(p->insns_num, sizeof(bool));
+  for (int i = 0; i < p->insns_num; i++) {
+    const int target = instruction_target(&p->insns[i]);
+    if (p->owner[i] >= 0 && target >= 0) targets[p->index[target]] = true;
+  }
+  for (int f = 0; f < p->functions_num; f++) {
+    targets[p->index[p->functions[f].begin]] = true;
+  }
+
+  // position[i] is the index of the first output item produced at or after the original instruction i
+  int *position = checked_calloc(p->insns_num, sizeof(int));
+  item *out = checked_calloc(p->insns_num, sizeof(item));
+  int n = 0;
+  for (int i = 0; i < p->insns_num; i++) {
+    position[i] = n;
+    instruction insn = p->insns[i];
+    // Unreachable code is dropped, the final STOP terminates the code section
+    if (p->owner[i] < 0 && insn.h != STOP) continue;
+
+    if (is(&insn, CONST, JMP) || is(&insn, CONTROL, CJMPz) || is(&insn, CONTROL, CJMPnz)) {
+      insn.args[0] = thread_jump(p, insn.args[0]);
+    }
+    if (is(&insn, CONST, JMP)) {
+      const instruction *t = &p->insns[p->index[insn.args[0]]];
+      if (insn.args[0] == insn.next) continue;
+      if (is(t, CONST, END) || is(t, CONST, RET)) insn = *t;
+    }
+    out[n].insn = insn;
+    out[n].target = targets[i];
+    n++;
+    while (reduce(out, &n)) {}
+  }
+
+  // Assign the new offsets and remap the targets
+  unsigned int *offsets = checked_calloc(n + 1, sizeof(unsigned int));
+  for (int k = 0; k < n; k++) {
+    offsets[k + 1] = offsets[k] + instruction_size(&out[k].insn);
+  }
+  if (offsets[n] > bf->code_size) {
+    failure("*** FAILURE: optimized code is longer than the original\n");
+  }
+  char *code = checked_calloc(offsets[n], 1);
+  for (int k = 0; k < n; k++) {
+    instruction *insn = &out[k].insn;
+    if (instruction_target(insn) >= 0) {
+      insn->args[0] = offsets[position[p->index[insn->args[0]]]];
+    }
+    encode_instruction(insn, code + offsets[k]);
+  }
+  for (unsigned int i = 0; i < bf->public_symbols_number; i++) {
+    const int offset = bf->public_ptr[i * 2 + 1];
+    if (offset >= 0 && offset < bf->code_size && p->index[offset] >= 0) {
+      bf->public_ptr[i * 2 + 1] = offsets[position[p->index[offset]]];
+    }
+  }
+  bf->entrypoint_offset = offsets[position[p->index[bf->entrypoint_offset]]];
+  if (counts != NULL) {
+    // The count of a removed instruction goes to the one after it, which then runs at least as often
+    unsigned long long *moved = checked_calloc(bf->code_size, sizeof(unsigned long long));
+    for (int i = 0; i < p->insns_num; i++) {
+      unsigned long long *count = &moved[offsets[position[i]]];
+      if (counts[p->insns[i].offset] > *count) *count = counts[p->insns[i].offset];
+    }
+    memcpy(counts, moved, bf->code_size * sizeof(unsigned long long));
+    free(moved);
+  }
+
+  // Captured variables of closures are copied from the old code, so the old code is overwritten only now
+  memcpy(bf->code_ptr, code, offsets[n]);
+  bf->code_size = offsets[n];
+
+  free(code);
+  free(offsets);
+  free(out);
+  free(position);
+  free(targets);
+  free_program(p);
+  return bf->code_size;
+}
+
+void optimize(bytefile *bf, unsigned long long *counts) {
+  unsigned long size = bf->code_size;
+  for (int round = 0; round < MAX_ROUNDS; round++) {
+    const unsigned long new_size = optimize_round(bf, counts);
+    if (new_size == size) break;
+    size = new_size;
+  }
+}
@@ -0,0 +1,16 @@
+//
+// Load-time bytecode optimizer: dead code elimination, jump threading,
+// constant folding and peephole simplifications. The code section is
+// rewritten in place, since the optimized code is never longer
+//
+
+#ifndef HW2_OPTIMIZER_H
+#define HW2_OPTIMIZER_H
+
+#include "interpreter.h"
+
+/* Rewrites the code section of the file and updates the offset of main. The execution counts of a profile, if
+   given, are moved to the new offsets of their instructions */
+void optimize(bytefile *bf, unsigned long long *counts);
+
+#endif //HW2_OPTIMIZER_H
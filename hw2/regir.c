@@ -0,0 +1,902 @@
+//
+// Translation of the stack bytecode into the register IR
+//
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regir.h"
+#include "callees.h"
+#include "escape.h"
+#include "types.h"
+#include "runtime.h"
+
+extern aint LtagHash(char *);
+
+// Callees of at most this many bytecode instructions are inlined into their callers, nested up to the depth
+#define INLINE_MAX_SIZE 24
+#define INLINE_MAX_DEPTH 3
+
+// The code of a function being translated: either the function itself or its body inlined at a CALL. Inlined
+// arguments, locals and operands occupy operand positions of the frame the body is inlined into
+typedef struct scope {
+  const function *f;
+  const struct scope *outer;    // Scope of the inlined CALL, NULL if the frame is the function's own
+  int args_base;                // Positions of the first argument, the first local and the bottom of the stack
+  int locals_base;
+  int stack_base;
+  const uint64_t *live;         // Stack maps of the inlined CALL, the frame is suspended in the callee
+  const uint64_t *live_fields;
+  int at[INLINE_MAX_SIZE];      // Instruction k of the inlined function -> index of its first IR instruction
+  int returns[INLINE_MAX_SIZE]; // Jumps from the inlined returns to the instruction after the body
+  int returns_num;
+  bool last;                    // The instruction being translated is the last one of the inlined body
+} scope;
+
+// An object of the static region: its tag, the code offset, tag hash or string table position it was created
+// from, and the constant referring to it
+typedef struct {
+  auint tag;
+  aint value;
+  reg r;
+} static_ref;
+
+// The operand stack is tracked at load time: every position holds the operand its value can be read from.
+// A position is materialized when the operand is its own temporary slot, other operands are variables,
+// constants or lower temporaries copied by DUP. Positions are materialized before control flow merges and
+// before anything that reads the stack in memory: calls, allocations and the collector
+typedef struct {
+  const program *p;
+  const stack_maps *maps;
+  reg_program *rp;
+  int capacity;
+  int consts_capacity;
+  const bool *labels;           // Instruction index -> some jump targets it
+  const unsigned char *types;   // Instruction index -> TYPE_INT_* flags of BINOP operands
+  const scalars *scalars;       // Allocations replaced by the fields kept in the frame
+  const int *callees;           // Instruction index -> code offset of the function a CALLC always calls, or -1
+  const function *f;            // Function owning the frame
+  int fields;                   // Frame slots of the fields, between the locals and the operands
+  scope *s;
+  reg *stack;
+  int depth;
+  int *jumps;                   // Jumps of the scopes being translated whose targets are bytecode offsets
+  int jumps_num;
+  int jumps_capacity;
+  int frame_depth;              // Operand slots used by the function including allocation arguments
+  int block_start;              // Index of the first instruction of the current straight-line code
+  unsigned int offset;          // Offset of the bytecode instruction being translated
+  static_ref *static_refs;      // Objects of the static region in the order of creation
+  size_t statics_end;           // Bytes of the static region taken
+} translator;
+
+// A capture-free closure or an s-expression without fields is immutable, so a single instance of each is created
+// at load time. So is a string literal that is only read where it is pushed. The static region is outside the heap:
+// the collector never marks, moves or frees its objects
+#define STATIC_OBJECT_SIZE (DATA_HEADER_SZ + MEMBER_SIZE)
+#define STATIC_STRING_SIZE(len) (DATA_HEADER_SZ + WORDS_TO_BYTES(BYTES_TO_WORDS((len) + 1)))
+
+// Instructions looked at after a string literal for the one consuming it
+#define LITERAL_LOOKAHEAD 8
+
+static void *checked_realloc(void *p, const size_t n, const size_t size) {
+  p = realloc(p, (n == 0 ? 1 : n) * size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static reg_insn *emit(translator *t, const reg_opcode op) {
+  reg_program *rp = t->rp;
+  if (rp->insns_num == t->capacity) {
+    t->capacity = t->capacity * 2 + 16;
+    rp->insns = checked_realloc(rp->insns, t->capacity, sizeof(reg_insn));
+  }
+  reg_insn *i = &rp->insns[rp->insns_num++];
+  memset(i, 0, sizeof(reg_insn));
+  i->op = op;
+  i->offset = t->offset;
+  return i;
+}
+
+static bool inlined(const translator *t) {
+  return t->s->outer != NULL;
+}
+
+static reg temp(const translator *t, const int k) {
+  return REG(REG_FRAME, -1 - t->f->locals_num - t->fields - k);
+}
+
+static bool is_temp(const translator *t, const reg r) {
+  return REG_BASE(r) == REG_FRAME && REG_OFFSET(r) < -t->f->locals_num - t->fields;
+}
+
+/* Offset of the stack top from ebp when the operand stack has the depth */
+static int stack_top(const translator *t, const int depth) {
+  return -t->f->locals_num - t->fields - depth;
+}
+
+/* Frame slot of a field of a replaced allocation */
+static reg field(const translator *t, const int slot) {
+  return REG(REG_FRAME, -1 - t->f->locals_num - slot);
+}
+
+/* Live field slots of the frame suspended at the instruction */
+static const uint64_t *live_fields(const translator *t, const instruction *insn) {
+  if (inlined(t)) return t->s->live_fields;
+  const int map = t->scalars->live_fields[t->p->index[insn->offset]];
+  return map < 0 ? NULL : &t->rp->field_maps[map];
+}
+
+/* Slot of the fields of the allocation or of the field read by the ELEM, -1 if the instruction is translated as is.
+   Inlined bodies are not in the frame of their function, their allocations are made */
+static int scalar_slot(const translator *t, const instruction *insn) {
+  return inlined(t) ? -1 : t->scalars->slot[t->p->index[insn->offset]];
+}
+
+static void use_slots(translator *t, const int depth) {
+  if (depth > t->frame_depth) t->frame_depth = depth;
+}
+
+/* Returns one more than the greatest index of a captured variable the function reads, writes or captures again */
+static int closure_vars(const program *p, const function *f) {
+  int n = 0;
+  for (int k = 0; k < f->insns_num; k++) {
+    const instruction *i = &p->insns[f->insns[k]];
+    if ((i->h == LD || i->h == ST) && i->l == CLOSURE_VAR && i->args[0] >= n) {
+      n = i->args[0] + 1;
+    }
+    for (int c = 0; i->h == CONTROL && i->l == MAKE_CLOSURE && c < i->args[1]; c++) {
+      unsigned char designation;
+      int index;
+      closure_capture(i, c, &designation, &index);
+      if (designation == CLOSURE_VAR && index >= n) n = index + 1;
+    }
+  }
+  return n;
+}
+
+static reg constant(translator *t, const aint value) {
+  reg_program *rp = t->rp;
+  if (rp->consts_num == t->consts_capacity) {
+    t->consts_capacity = t->consts_capacity * 2 + 16;
+    rp->consts = checked_realloc(rp->consts, t->consts_capacity, sizeof(aint));
+  }
+  rp->consts[rp->consts_num] = value;
+  return REG(REG_CONST, rp->consts_num++);
+}
+
+/* Returns the constant referring to the static closure of the code offset, s-expression of the tag hash or string
+   at the string table position */
+static reg static_object(translator *t, const auint tag, const aint value) {
+  reg_program *rp = t->rp;
+  for (int k = 0; k < rp->statics_num; k++) {
+    if (t->static_refs[k].tag == tag && t->static_refs[k].value == value) return t->static_refs[k].r;
+  }
+  data *d = (data *) (rp->statics + t->statics_end);
+  d->forward_address = 0;
+  if (tag == STRING_TAG) {
+    const char *str = get_string(t->p->bf, value);
+    const size_t len = strlen(str);
+    d->data_header = STRING_TAG | (len << 3);
+    memcpy(d->contents, str, len + 1);
+    t->statics_end += STATIC_STRING_SIZE(len);
+  } else {
+    // The only word of the contents is the code offset of a closure and the tag of an s-expression
+    d->data_header = tag == CLOSURE_TAG ? CLOSURE_TAG | (1 << 3) : SEXP_TAG;
+    *(aint *) d->contents = value;
+    t->statics_end += STATIC_OBJECT_SIZE;
+  }
+  const reg r = constant(t, (aint) d->contents);
+  t->static_refs[rp->statics_num++] = (static_ref) {tag, value, r};
+  return r;
+}
+
+/* Whether the string literal pushed by the instruction is only read: the instruction consuming it, looked for over
+   the loads and constants pushed above it in the same block, compares, inspects or indexes it. A literal that may
+   be stored, passed to a function or built into another object gets a fresh copy, as it may be changed */
+static bool literal_is_read(const translator *t, const instruction *insn) {
+  const program *p = t->p;
+  const int f = p->owner[p->index[insn->offset]];
+  int above = 0;
+  unsigned int offset = insn->next;
+  for (int n = 0; n < LITERAL_LOOKAHEAD && offset < p->bf->code_size; n++) {
+    const int k = p->index[offset];
+    if (k < 0 || p->owner[k] != f || t->labels[k]) return false;
+    const instruction *i = &p->insns[k];
+    offset = i->next;
+    switch (i->h) {
+      case LD:
+        above++;
+        continue;
+      case CONST:
+        if (i->l == CONST_INT) {
+          above++;
+          continue;
+        }
+        if (i->l == DROP) {
+          if (above == 0) return true;
+          above--;
+          continue;
+        }
+        // ELEM reads the literal as the array, as the index it fails on it
+        return i->l == ELEM && above <= 1;
+      case PATT:
+        return above == 0 || (i->l == PATT_STR_EQ && above == 1);
+      case BUILTIN:
+        return above == 0 && (i->l == BUILTIN_Llength || i->l == BUILTIN_Lstring);
+      case CONTROL:
+        if (i->l == LINE) continue;
+        return false;
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+/* Returns the operand of a global, local or argument, captured variables have no operand */
+static reg variable(const translator *t, const unsigned char designation, const int index) {
+  const scope *s = t->s;
+  switch (designation) {
+    case GLOBAL:
+      if (index < 0 || index >= t->p->bf->global_area_size) {
+        failure("Global variable %d out of bounds. Number of globals %d\n", index, t->p->bf->global_area_size);
+      }
+      return REG(REG_GLOBAL, index);
+    case LOCAL:
+      if (index < 0 || index >= s->f->locals_num) {
+        failure("Local variable %d out of bounds. Number of locals %d\n", index, s->f->locals_num);
+      }
+      return inlined(t) ? temp(t, s->locals_base + index) : REG(REG_FRAME, -1 - index);
+    case ARG:
+      return inlined(t) ? temp(t, s->args_base + index) : REG(REG_FRAME, s->f->args_num - 1 - index);
+    case CLOSURE_VAR:
+      return REG(REG_CLOSURE, index);
+    default:
+      failure("*** FAILURE: invalid variable designation %d at 0x%.8x\n", designation, t->offset);
+  }
+  return 0;
+}
+
+static void materialize(translator *t, const int k) {
+  if (t->stack[k] != temp(t, k)) {
+    reg_insn *i = emit(t, R_MOVE);
+    i->dst = temp(t, k);
+    i->a = t->stack[k];
+    t->stack[k] = temp(t, k);
+  }
+}
+
+static void materialize_all(translator *t) {
+  for (int k = 0; k < t->depth; k++) {
+    materialize(t, k);
+  }
+}
+
+static void reset(translator *t, const int depth) {
+  t->depth = depth;
+  for (int k = 0; k < depth; k++) {
+    t->stack[k] = temp(t, k);
+  }
+  t->block_start = t->rp->insns_num;
+}
+
+static reg pop(translator *t) {
+  return t->stack[--t->depth];
+}
+
+/* Pushes the result of an instruction writing its own temporary slot and returns the slot */
+static reg push_temp(translator *t) {
+  const reg r = temp(t, t->depth);
+  t->stack[t->depth++] = r;
+  return r;
+}
+
+static reg_insn *gc_point(translator *t, const reg_opcode op, const instruction *insn, const int depth) {
+  materialize_all(t);
+  reg_insn *i = emit(t, op);
+  i->sp = stack_top(t, depth);
+  // Variables of a frame suspended in an inlined body are those live after the inlined call
+  i->live = inlined(t) ? t->s->live : stack_map_at(t->maps, insn->next);
+  i->live_fields = live_fields(t, insn);
+  use_slots(t, depth);
+  return i;
+}
+
+/* Keeps the values on top of the stack in the field slots of a replaced allocation, the object is never read */
+static void replace_allocation(translator *t, const int slot, const int n) {
+  // Fields of an object made by the allocation before may still be on the stack
+  for (int k = 0; k < t->depth; k++) {
+    const reg r = t->stack[k];
+    if (REG_BASE(r) == REG_FRAME && REG_OFFSET(r) <= REG_OFFSET(field(t, slot)) &&
+        REG_OFFSET(r) >= REG_OFFSET(field(t, slot + n - 1))) {
+      materialize(t, k);
+    }
+  }
+  t->depth -= n;
+  for (int k = 0; k < n; k++) {
+    if (t->stack[t->depth + k] != field(t, slot + k)) {
+      reg_insn *i = emit(t, R_MOVE);
+      i->dst = field(t, slot + k);
+      i->a = t->stack[t->depth + k];
+    }
+  }
+  t->stack[t->depth++] = constant(t, BOX(0));
+}
+
+/* RET of a replaced object: its fields are copied to the arguments and beyond, which are the operand slots of the
+   caller from the result on. Sources lie below the destinations, so copying from the first field overwrites none */
+static void return_fields(translator *t, const int slot, const int n) {
+  const int args_num = t->f->args_num;
+  for (int k = 0; k < n; k++) {
+    if (field(t, slot + k) != REG(REG_FRAME, args_num - 1 - k)) {
+      reg_insn *i = emit(t, R_MOVE);
+      i->dst = REG(REG_FRAME, args_num - 1 - k);
+      i->a = field(t, slot + k);
+    }
+  }
+  emit(t, R_RET)->a = REG(REG_FRAME, args_num - 1);
+}
+
+/* The outcome of ARRAY or TAG on a replaced object is known */
+static bool known_check(translator *t, const instruction *insn) {
+  const int check = inlined(t) ? -1 : t->scalars->check[t->p->index[insn->offset]];
+  if (check < 0) return false;
+  pop(t);
+  t->stack[t->depth++] = constant(t, BOX(check));
+  return true;
+}
+
+static reg_insn *unary(translator *t, const reg_opcode op) {
+  reg_insn *i = emit(t, op);
+  i->a = pop(t);
+  i->dst = push_temp(t);
+  return i;
+}
+
+static void jump(translator *t, const reg_opcode op, const reg condition, const int offset) {
+  if (t->jumps_num == t->jumps_capacity) {
+    t->jumps_capacity = t->jumps_capacity * 2 + 16;
+    t->jumps = checked_realloc(t->jumps, t->jumps_capacity, sizeof(int));
+  }
+  t->jumps[t->jumps_num++] = t->rp->insns_num;
+  reg_insn *i = emit(t, op);
+  i->a = condition;
+  i->target = offset;
+}
+
+/* ST into a variable: the value stays on the stack, so it is either written directly by the instruction that
+   computed it or copied. A captured variable is a field of the closure, which is written by STC only */
+static void store(translator *t, const reg x) {
+  if (REG_BASE(x) == REG_CLOSURE) {
+    for (int k = 0; k < t->depth - 1; k++) {
+      if (t->stack[k] == x) materialize(t, k);
+    }
+    reg_insn *i = emit(t, R_STC);
+    i->dst = x;
+    i->a = t->stack[t->depth - 1];
+    return;
+  }
+  bool referenced = false;
+  for (int k = 0; k < t->depth - 1; k++) {
+    referenced |= t->stack[k] == x;
+  }
+  const int top = t->depth - 1;
+  const reg_program *rp = t->rp;
+  reg_insn *last = rp->insns_num > t->block_start ? &rp->insns[rp->insns_num - 1] : NULL;
+  if (!referenced && last != NULL && t->stack[top] == temp(t, top) && last->dst == t->stack[top] &&
+      ((last->op < R_BEGIN && last->op != R_SWAP) || last->op == R_CALL || last->op == R_CALLC)) {
+    last->dst = x;
+    t->stack[top] = x;
+    return;
+  }
+  for (int k = 0; k < t->depth; k++) {
+    if (t->stack[k] == x) materialize(t, k);
+  }
+  if (t->stack[top] != x) {
+    reg_insn *i = emit(t, R_MOVE);
+    i->dst = x;
+    i->a = t->stack[top];
+  }
+}
+
+static void inline_return(translator *t);
+static bool inline_call(translator *t, const instruction *insn);
+
+static void translate_instruction(translator *t, const instruction *insn) {
+  const program *p = t->p;
+  const bytefile *bf = p->bf;
+  reg_insn *i;
+  switch (insn->h) {
+    case BINOP:
+      if (t->types[p->index[insn->offset]] == TYPE_INT_BOTH) {
+        i = emit(t, R_ADD + insn->l - 1);
+      } else {
+        i = emit(t, R_BINOP);
+      }
+      i->sub = insn->l - 1;
+      i->b = pop(t);
+      i->a = pop(t);
+      i->dst = push_temp(t);
+      break;
+
+    case CONST:
+      switch (insn->l) {
+        case CONST_INT:
+          t->stack[t->depth++] = constant(t, BOX(insn->args[0]));
+          break;
+        case CONST_STRING:
+          if (literal_is_read(t, insn)) {
+            t->stack[t->depth++] = static_object(t, STRING_TAG, insn->args[0]);
+            break;
+          }
+          i = gc_point(t, R_STRING, insn, t->depth);
+          i->str = get_string(bf, insn->args[0]);
+          i->dst = push_temp(t);
+          break;
+        case MAKE_SEXP:
+          if (insn->args[1] == 0) {
+            const aint hash = LtagHash((char *) get_string(bf, insn->args[0]));
+            t->stack[t->depth++] = static_object(t, SEXP_TAG, UNBOX(hash));
+            break;
+          }
+          if (scalar_slot(t, insn) >= 0) {
+            replace_allocation(t, scalar_slot(t, insn), insn->args[1]);
+            break;
+          }
+          // The tag hash is stored right above the values, as Bsexp_reversed expects
+          i = gc_point(t, R_SEXP, insn, t->depth + 1);
+          i->hash = LtagHash((char *) get_string(bf, insn->args[0]));
+          i->imm = insn->args[1];
+          t->depth -= insn->args[1];
+          i->dst = push_temp(t);
+          break;
+        case STA:
+          i = emit(t, R_STA);
+          i->c = pop(t);
+          i->b = pop(t);
+          i->a = pop(t);
+          i->dst = push_temp(t);
+          break;
+        case JMP:
+          materialize_all(t);
+          jump(t, R_JMP, 0, insn->args[0]);
+          break;
+        case END:
+        case RET:
+          if (inlined(t)) {
+            inline_return(t);
+            break;
+          }
+          if (scalar_slot(t, insn) >= 0) {
+            return_fields(t, scalar_slot(t, insn), t->scalars->returned_fields[t->f - p->functions]);
+            break;
+          }
+          i = emit(t, R_RET);
+          i->a = t->depth > 0 ? pop(t) : constant(t, BOX(0));
+          break;
+        case DROP:
+          pop(t);
+          break;
+        case DUP:
+          t->stack[t->depth] = t->stack[t->depth - 1];
+          t->depth++;
+          break;
+        case SWAP: {
+          const int a = t->depth - 2, b = t->depth - 1;
+          if (!is_temp(t, t->stack[a]) && !is_temp(t, t->stack[b])) {
+            const reg r = t->stack[a];
+            t->stack[a] = t->stack[b];
+            t->stack[b] = r;
+            break;
+          }
+          materialize(t, a);
+          materialize(t, b);
+          i = emit(t, R_SWAP);
+          i->a = t->stack[a];
+          i->b = t->stack[b];
+          break;
+        }
+        case ELEM:
+          if (scalar_slot(t, insn) >= 0) {
+            t->depth -= 2;
+            t->stack[t->depth++] = field(t, scalar_slot(t, insn));
+            break;
+          }
+          i = emit(t, R_ELEM);
+          i->b = pop(t);
+          i->a = pop(t);
+          i->dst = push_temp(t);
+          break;
+        default:
+          // STI
+          emit(t, R_ABORT)->imm = insn->offset;
+          t->depth -= 2;
+          push_temp(t);
+          break;
+      }
+      break;
+
+    case LD:
+      t->stack[t->depth++] = variable(t, insn->l, insn->args[0]);
+      break;
+
+    case LDA:
+      emit(t, R_ABORT)->imm = insn->offset;
+      push_temp(t);
+      break;
+
+    case ST:
+      store(t, variable(t, insn->l, insn->args[0]));
+      break;
+
+    case CONTROL:
+      switch (insn->l) {
+        case CJMPz:
+        case CJMPnz: {
+          const reg condition = pop(t);
+          materialize_all(t);
+          if (REG_BASE(condition) == REG_CONST) {
+            // Checks of replaced objects are constants, the jump is either always taken or never
+            const bool zero = UNBOX(t->rp->consts[REG_OFFSET(condition)]) == 0;
+            if (zero == (insn->l == CJMPz)) jump(t, R_JMP, 0, insn->args[0]);
+            break;
+          }
+          jump(t, insn->l == CJMPz ? R_JZ : R_JNZ, condition, insn->args[0]);
+          break;
+        }
+        case BEGIN:
+        case CBEGIN:
+          if (inlined(t)) {
+            // Locals are scanned by the collector as operands, so they are initialized as BEGIN does
+            for (int k = 0; k < insn->args[1]; k++) {
+              i = emit(t, R_MOVE);
+              i->dst = temp(t, t->s->locals_base + k);
+              i->a = constant(t, BOX(0));
+            }
+            break;
+          }
+          i = emit(t, R_BEGIN);
+          i->args_num = insn->args[0];
+          i->locals_num = insn->args[1];
+          i->fields_num = t->fields;
+          i->closure_vars = closure_vars(t->p, t->s->f);
+          break;
+        case MAKE_CLOSURE: {
+          const int n = insn->args[1];
+          if (n == 0) {
+            t->stack[t->depth++] = static_object(t, CLOSURE_TAG, insn->args[0]);
+            break;
+          }
+          i = gc_point(t, R_CLOSURE, insn, t->depth);
+          use_slots(t, t->depth + n + 1);
+          i->target = insn->args[0];
+          i->imm = n;
+          i->captures = checked_realloc(NULL, n, sizeof(reg));
+          for (int k = 0; k < n; k++) {
+            unsigned char designation;
+            int index;
+            closure_capture(insn, k, &designation, &index);
+            i->captures[k] = variable(t, designation, index);
+          }
+          i->dst = push_temp(t);
+          break;
+        }
+        case CALLC: {
+          // A call of a known closure is direct, the closure stays below the arguments for the callee
+          const int callee = t->callees[p->index[insn->offset]];
+          i = gc_point(t, callee >= 0 ? R_CALL : R_CALLC, insn, t->depth);
+          i->target = callee;
+          i->imm = insn->args[0];
+          t->depth -= insn->args[0] + 1;
+          i->dst = push_temp(t);
+          break;
+        }
+        case CALL: {
+          if (inline_call(t, insn)) break;
+          i = gc_point(t, R_CALL, insn, t->depth);
+          i->target = insn->args[0];
+          i->imm = insn->args[1];
+          t->depth -= insn->args[1];
+          i->dst = push_temp(t);
+          if (scalar_slot(t, insn) >= 0) {
+            // The callee left the fields of its result in the operand slots from the result on
+            const int n = t->scalars->returned_fields[p->owner[p->index[insn->args[0]]]];
+            for (int k = 1; k < n; k++) {
+              push_temp(t);
+            }
+            use_slots(t, t->depth);
+            replace_allocation(t, scalar_slot(t, insn), n);
+          }
+          break;
+        }
+        case TAG:
+          if (known_check(t, insn)) break;
+          i = unary(t, R_TAG);
+          i->hash = LtagHash((char *) get_string(bf, insn->args[0]));
+          i->imm = insn->args[1];
+          break;
+        case MAKE_ARRAY:
+          if (known_check(t, insn)) break;
+          unary(t, R_ARRAY)->imm = insn->args[0];
+          break;
+        case FAIL_I:
+          i = emit(t, R_FAIL);
+          i->imm = insn->args[0];
+          i->target = insn->args[1];
+          break;
+        default:
+          // LINE
+          break;
+      }
+      break;
+
+    case PATT:
+      if (insn->l == PATT_STR_EQ) {
+        i = emit(t, R_PATT);
+        i->b = pop(t);
+        i->a = pop(t);
+        i->dst = push_temp(t);
+      } else {
+        i = unary(t, R_PATT);
+      }
+      i->sub = insn->l;
+      break;
+
+    case BUILTIN:
+      switch (insn->l) {
+        case BUILTIN_Lread:
+          emit(t, R_LREAD)->dst = push_temp(t);
+          break;
+        case BUILTIN_Lwrite:
+          unary(t, R_LWRITE);
+          break;
+        case BUILTIN_Llength:
+          unary(t, R_LLENGTH);
+          break;
+        case BUILTIN_Lstring:
+          i = gc_point(t, R_LSTRING, insn, t->depth);
+          t->depth--;
+          i->dst = push_temp(t);
+          break;
+        default:
+          if (scalar_slot(t, insn) >= 0) {
+            replace_allocation(t, scalar_slot(t, insn), insn->args[0]);
+            break;
+          }
+          i = gc_point(t, R_BARRAY, insn, t->depth);
+          i->imm = insn->args[0];
+          t->depth -= insn->args[0];
+          i->dst = push_temp(t);
+          break;
+      }
+      break;
+
+    default:
+      emit(t, R_ABORT)->imm = insn->offset;
+      break;
+  }
+  use_slots(t, t->depth);
+}
+
+static int entry(const reg_program *rp, const int offset) {
+  if (offset < 0 || offset >= rp->code_size || rp->entry_of[offset] < 0) {
+    failure("*** FAILURE: control transfer to 0x%.8x is not an instruction boundary\n", offset);
+  }
+  return rp->entry_of[offset];
+}
+
+/* Translates the instructions of the scope and resolves its jumps, which never leave the function */
+static void translate_body(translator *t) {
+  const program *p = t->p;
+  scope *s = t->s;
+  const int jumps_mark = t->jumps_num;
+  int prev = -1;
+  for (int k = 0; k < s->f->insns_num; k++) {
+    const int insn = s->f->insns[k];
+    const instruction *i = &p->insns[insn];
+    t->offset = i->offset;
+    const bool fallthrough = prev >= 0 && prev == insn - 1 && !instruction_is_terminal(&p->insns[prev]);
+    if (!fallthrough || t->labels[insn]) {
+      if (fallthrough) materialize_all(t);
+      reset(t, s->stack_base + p->depth[insn]);
+    }
+    if (inlined(t)) {
+      s->at[k] = t->rp->insns_num;
+    } else {
+      t->rp->entry_of[i->offset] = t->rp->insns_num;
+    }
+    s->last = k == s->f->insns_num - 1;
+    translate_instruction(t, i);
+    prev = insn;
+  }
+  for (int j = jumps_mark; j < t->jumps_num; j++) {
+    reg_insn *i = &t->rp->insns[t->jumps[j]];
+    if (!inlined(t)) {
+      i->target = entry(t->rp, i->target);
+      continue;
+    }
+    const int target = p->index[i->target];
+    int k = 0;
+    while (s->f->insns[k] != target) k++;
+    i->target = s->at[k];
+  }
+  t->jumps_num = jumps_mark;
+}
+
+/* Inlines only small functions that do not refer to a closure, the arguments must match */
+static bool inlinable(const program *p, const function *f, const int args_num) {
+  if (f->insns_num > INLINE_MAX_SIZE || f->args_num != args_num || f->begin == p->bf->entrypoint_offset) {
+    return false;
+  }
+  for (int k = 0; k < f->insns_num; k++) {
+    const instruction *i = &p->insns[f->insns[k]];
+    if (((i->h == LD || i->h == LDA || i->h == ST) && i->l == CLOSURE_VAR) || (i->h == CONTROL && i->l == CBEGIN) ||
+        i->h == STOP) {
+      return false;
+    }
+    for (int c = 0; i->h == CONTROL && i->l == MAKE_CLOSURE && c < i->args[1]; c++) {
+      unsigned char designation;
+      int index;
+      closure_capture(i, c, &designation, &index);
+      if (designation == CLOSURE_VAR) return false;
+    }
+  }
+  return true;
+}
+
+/* Whether the function returns fields or takes them from a call, for which it needs a frame of its own */
+static bool passes_fields(const translator *t, const function *f) {
+  const program *p = t->p;
+  if (t->scalars->returned_fields[f - p->functions] > 0) return true;
+  for (int k = 0; k < f->insns_num; k++) {
+    const instruction *i = &p->insns[f->insns[k]];
+    if (i->h == CONTROL && i->l == CALL && t->scalars->returned_fields[p->owner[p->index[i->args[0]]]] > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Splices the body of the called function into the frame: its arguments stay where the caller pushed them, its
+   locals and operands follow, and the result replaces the first argument as after RET */
+static bool inline_call(translator *t, const instruction *insn) {
+  const program *p = t->p;
+  const int args_num = insn->args[1];
+  const function *callee = &p->functions[p->owner[p->index[insn->args[0]]]];
+  if (!inlinable(p, callee, args_num) || passes_fields(t, callee)) return false;
+  int nesting = 0;
+  for (const scope *s = t->s; s != NULL; s = s->outer) {
+    if (s->f == callee || ++nesting > INLINE_MAX_DEPTH) return false;
+  }
+
+  materialize_all(t);
+  scope s = {
+    .f = callee,
+    .outer = t->s,
+    .args_base = t->depth - args_num,
+    .locals_base = t->depth,
+    .stack_base = t->depth + callee->locals_num,
+    .live = inlined(t) ? t->s->live : stack_map_at(t->maps, insn->next),
+    .live_fields = live_fields(t, insn),
+  };
+  const unsigned int offset = t->offset;
+  t->s = &s;
+  translate_body(t);
+  t->s = (scope *) s.outer;
+  t->offset = offset;
+
+  for (int k = 0; k < s.returns_num; k++) {
+    t->rp->insns[s.returns[k]].target = t->rp->insns_num;
+  }
+  reset(t, s.args_base);
+  push_temp(t);
+  use_slots(t, s.stack_base);
+  return true;
+}
+
+/* RET of an inlined body: the result is stored where RET would put it and the control continues after the call */
+static void inline_return(translator *t) {
+  scope *s = t->s;
+  const reg result = t->depth > s->stack_base ? pop(t) : constant(t, BOX(0));
+  if (result != temp(t, s->args_base)) {
+    reg_insn *i = emit(t, R_MOVE);
+    i->dst = temp(t, s->args_base);
+    i->a = result;
+  }
+  if (!s->last) {
+    s->returns[s->returns_num++] = t->rp->insns_num;
+    emit(t, R_JMP);
+  }
+}
+
+static void translate_function(translator *t, const function *f) {
+  scope s = {.f = f};
+  t->f = f;
+  t->fields = t->scalars->slots_num[f - t->p->functions];
+  t->s = &s;
+  t->frame_depth = 0;
+  translate_body(t);
+  t->rp->insns[t->rp->entry_of[f->begin]].imm = f->locals_num + t->fields + t->frame_depth;
+}
+
+reg_program *translate_program(const program *p, const stack_maps *maps) {
+  reg_program *rp = checked_realloc(NULL, 1, sizeof(reg_program));
+  memset(rp, 0, sizeof(reg_program));
+  rp->code_size = p->bf->code_size;
+  rp->entry_of = checked_realloc(NULL, rp->code_size, sizeof(int));
+  memset(rp->entry_of, -1, rp->code_size * sizeof(int));
+
+  bool *labels = checked_realloc(NULL, p->insns_num, sizeof(bool));
+  memset(labels, 0, p->insns_num * sizeof(bool));
+  // Every inlined body may add its locals and operands to the frame
+  int max_frame = 0;
+  int statics = 0;
+  size_t statics_size = 0;
+  for (int f = 0; f < p->functions_num; f++) {
+    const int frame = p->functions[f].locals_num + p->functions[f].max_depth;
+    if (frame > max_frame) max_frame = frame;
+    for (int k = 0; k < p->functions[f].insns_num; k++) {
+      const instruction *i = &p->insns[p->functions[f].insns[k]];
+      if ((i->h == CONST && i->l == JMP) || (i->h == CONTROL && (i->l == CJMPz || i->l == CJMPnz))) {
+        labels[p->index[i->args[0]]] = true;
+      }
+      if (((i->h == CONST && i->l == MAKE_SEXP) || (i->h == CONTROL && i->l == MAKE_CLOSURE)) && i->args[1] == 0) {
+        statics++;
+        statics_size += STATIC_OBJECT_SIZE;
+      } else if (i->h == CONST && i->l == CONST_STRING) {
+        statics++;
+        statics_size += STATIC_STRING_SIZE(strlen(get_string(p->bf, i->args[0])));
+      }
+    }
+  }
+  // The objects never move, so the region is allocated once for the most objects the program may need
+  rp->statics = checked_realloc(NULL, statics_size, 1);
+  memset(rp->statics, 0, statics_size == 0 ? 1 : statics_size);
+  rp->statics_size = statics_size;
+  unsigned char *types = infer_types(p);
+  scalars *scalars = find_scalars(p);
+  // The maps of the field slots outlive the analysis
+  rp->field_maps = scalars->field_maps;
+  scalars->field_maps = NULL;
+  int *callees = find_callees(p);
+  translator t = {
+    .p = p, .maps = maps, .rp = rp, .labels = labels, .types = types, .scalars = scalars, .callees = callees
+  };
+  t.static_refs = checked_realloc(NULL, statics, sizeof(static_ref));
+  t.stack = checked_realloc(NULL, (max_frame + 1) * (INLINE_MAX_DEPTH + 2), sizeof(reg));
+
+  for (int f = 0; f < p->functions_num; f++) {
+    translate_function(&t, &p->functions[f]);
+  }
+  for (int k = 0; k < rp->insns_num; k++) {
+    if (rp->insns[k].op == R_CALL) {
+      rp->insns[k].target = entry(rp, rp->insns[k].target);
+    }
+  }
+  rp->entry = entry(rp, p->bf->entrypoint_offset);
+
+  free(t.static_refs);
+  free(t.jumps);
+  free(t.stack);
+  free(callees);
+  free_scalars(scalars);
+  free(types);
+  free(labels);
+  return rp;
+}
+
+void free_reg_program(reg_program *rp) {
+  for (int k = 0; k < rp->insns_num; k++) {
+    free(rp->insns[k].captures);
+  }
+  free(rp->insns);
+  free(rp->entry_of);
+  free(rp->consts);
+  free(rp->statics);
+  free(rp->field_maps);
+  free(rp);
+}
@@ -0,0 +1,122 @@
+//
+// Register-based intermediate representation. Every function is translated
+// into three-address instructions over the slots of its frame: the operand
+// stack is resolved at load time, so a value pushed by LD or CONST and
+// consumed by the next instruction never touches the stack.
+//
+// The value stack holds only Lama values. A frame from higher to lower
+// addresses: the closure (CALLC only), the args (ebp points to the last
+// one), the locals, the fields of the objects that are never allocated (see
+// escape.h) and the operand slots. The calling instruction, the frame
+// pointer and the BEGIN of the function are kept on a separate control
+// stack. Both calls leave the arguments where the caller computed them, the
+// result is stored by the caller into the destination of the call. A
+// function that returns the fields of an object instead copies them over
+// its arguments and below, from where the caller moves them to its own
+// field slots.
+//
+
+#ifndef HW2_REGIR_H
+#define HW2_REGIR_H
+
+#include <stdint.h>
+
+#include "analysis.h"
+#include "stackmap.h"
+
+// An operand is a word offset from a base: frame slots are relative to ebp,
+// globals to the global area, constants to the constant pool of the program and
+// captured variables to the contents of the current closure, which BEGIN checks once
+typedef int32_t reg;
+
+enum { REG_FRAME = 0, REG_GLOBAL = 1, REG_CONST = 2, REG_CLOSURE = 3 };
+
+#define REG(base, offset) ((reg) ((offset) * 4 + (base)))
+#define REG_BASE(r) ((r) & 3)
+#define REG_OFFSET(r) ((r) >> 2)
+
+typedef enum {
+  R_MOVE,                       // dst <- a
+  R_BINOP,                      // dst <- a op b, sub is the BINOP low nibble minus one
+  R_ADD,                        // dst <- a op b over operands proven to be unboxed integers, no tag checks.
+  R_SUB,                        // The order is that of the BINOP operators
+  R_MUL,
+  R_DIV,
+  R_MOD,
+  R_LT,
+  R_LE,
+  R_GT,
+  R_GE,
+  R_EQ,
+  R_NE,
+  R_AND,
+  R_OR,
+  R_JMP,                        // goto target
+  R_JZ,                         // if a == 0 goto target
+  R_JNZ,                        // if a != 0 goto target
+  R_SWAP,                       // a <-> b
+  R_ELEM,                       // dst <- a[b]
+  R_STA,                        // dst <- (a[b] = c)
+  R_STC,                        // captured variable dst <- a, through the write barrier of the collector
+  R_TAG,                        // dst <- a has tag hash and imm fields
+  R_ARRAY,                      // dst <- a is an array of imm elements
+  R_PATT,                       // dst <- pattern sub matches a (and b for =str)
+  R_LREAD,                      // dst <- read ()
+  R_LWRITE,                     // dst <- write (a)
+  R_LLENGTH,                    // dst <- length (a)
+  R_BEGIN,                      // function entry, imm is the number of locals, field and operand slots
+  R_RET,                        // return a
+  R_FAIL,                       // match failure at line imm, column target
+  R_ABORT,                      // instruction the interpreter does not support, imm is its bytecode offset
+
+  // The instructions below may call the collector, so the operand stack is stored to its slots before them
+  // and sp is the offset of the stack top from ebp
+  R_STRING,                     // dst <- copy of str
+  R_SEXP,                       // dst <- sexp with tag hash of the imm values on top of the stack
+  R_CLOSURE,                    // dst <- closure of code offset target with imm captured variables
+  R_LSTRING,                    // dst <- string (top)
+  R_BARRAY,                     // dst <- array of the imm values on top of the stack
+  R_CALL,                       // dst <- call target with imm arguments on top of the stack, for a CALLC of a known
+                                // closure the closure stays below them
+  R_CALLC,                      // dst <- call the closure below the imm arguments on top of the stack
+} reg_opcode;
+
+typedef struct {
+  uint8_t op;
+  uint8_t sub;                  // BINOP operator, PATT kind
+  reg dst, a, b, c;
+  int32_t imm;
+  int32_t target;               // Index of the jump or call target, bytecode offset for CLOSURE
+  int32_t sp;                   // Word offset of the operand stack top from ebp
+  aint hash;                    // Tag hash of SEXP and TAG
+  const char *str;              // STRING contents
+  reg *captures;                // CLOSURE captured variables
+  const uint64_t *live;         // Stack map of the frame while the instruction runs, NULL if not a GC point
+  const uint64_t *live_fields;  // Stack map of the field slots (see escape.h) while it runs, NULL to keep them all
+  unsigned int offset;          // Offset of the bytecode instruction it was translated from
+  int args_num, locals_num;     // BEGIN: frame shape
+  int fields_num;               // BEGIN: slots of the fields of replaced allocations, below the locals
+  int closure_vars;             // BEGIN: captured variables the function accesses, its closure has at least as many
+} reg_insn;
+
+struct reg_program {
+  reg_insn *insns;
+  int insns_num;
+  int entry;                    // Index of the BEGIN of main
+  int *entry_of;                // Bytecode offset -> index of the first instruction translated from it
+  aint *consts;                 // Boxed constants referred to by REG_CONST operands
+  int consts_num;
+  char *statics;                // Immortal objects outside the heap: capture-free closures, nullary s-expressions and
+                                // string literals that are only read
+  int statics_num;
+  size_t statics_size;          // Bytes reserved for them, the static area of the runtime while the program runs
+  uint64_t *field_maps;         // Stack maps of the field slots the instructions refer to
+  unsigned long code_size;
+};
+
+/* Translates every function of the program, the stack maps are attached to the GC points */
+reg_program *translate_program(const program *p, const stack_maps *maps);
+
+void free_reg_program(reg_program *rp);
+
+#endif //HW2_REGIR_H
@@ -1,5 +1,8 @@
+# Usage: run_tests.sh [build directory] [interpreter flags...], fails on the first program that does not exit cleanly
+build_dir=${1:-./cmake-build-debug}
+[ $# -gt 0 ] && shift
 for i in $(find ./regression -name "test*.bc" | sort);
 do
   filename=$(basename "$i" .bc)
-  ./cmake-build-debug/hw2 "./regression/$filename.bc" "./regression/$filename.lama"
-done
\ No newline at end of file
+  "$build_dir/hw2" "$@" "./regression/$filename.bc" "./regression/$filename.input" || { echo "FAILED $filename"; exit 1; }
+done
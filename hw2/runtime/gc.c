@@ -4,12 +4,17 @@
 
 #include "gc.h"
 
+#include "runtime.h"
 #include "runtime_common.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,15 +22,33 @@
 #include <time.h>
 #include <unistd.h>
 
-static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
+// Everything the collector keeps is per thread: a thread runs its program on its own heap and stack
 
 #ifdef DEBUG_VERSION
-size_t cur_id = 0;
+_Thread_local size_t cur_id = 0;
 #endif
 
-static extra_roots_pool extra_roots;
+static _Thread_local extra_roots_pool extra_roots;
 
-size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+_Thread_local gc_statistics gc_stats;
+
+gc_settings gc_config = {
+    .initial_heap_size = DEFAULT_INITIAL_HEAP_SIZE,
+    .max_heap_size     = HEAP_RESERVED_SIZE,
+    .gc_time_ratio     = DEFAULT_GC_TIME_RATIO,
+    .mark_threads      = 0,
+};
+
+// The state of the sizing policy
+static _Thread_local struct {
+  double factor;         // heap size over live size after the next major collection
+  double window_start;   // end of the last major collection
+  double gc_time;        // seconds spent collecting since then
+  double major_start;    // start of the running major collection
+} sizing;
+_Thread_local void (*gc_scan_stack_hook) (void) = NULL;
+
+_Thread_local size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 #ifdef __linux__
 extern const size_t __start_custom_data, __stop_custom_data;
@@ -36,11 +59,41 @@ extern const size_t __stop_custom_data __asm("section$end$__DATA$custom_data");
 #endif
 
 #ifdef DEBUG_VERSION
-memory_chunk heap;
+_Thread_local memory_chunk heap;
 #else
-static memory_chunk heap;
+static _Thread_local memory_chunk heap;
 #endif
 
+// The young generation. Objects are bump allocated here and promoted into the heap, the old generation, by a minor
+// collection when it is full
+_Thread_local memory_chunk gc_nursery;
+
+// A growable array of addresses the minor collection treats as roots
+typedef struct {
+  size_t **items;
+  size_t   size;
+  size_t   capacity;
+} remembered_set;
+
+// Fields of old objects a young object was stored into since the last minor collection, and the old objects allocated
+// since then, which the runtime fills without the write barrier
+static _Thread_local remembered_set remembered_fields, remembered_objects;
+
+// Objects found reachable by a major collection whose fields are still to be scanned. They are pushed without looking
+// at their mark bits, which would wait for the header of every field value, a marked object is skipped when popped
+static _Thread_local struct {
+  void **items;
+  size_t size;
+  size_t capacity;
+} mark_stack;
+
+// gc_test_and_mark_root promotes instead of marking while a minor collection runs
+static _Thread_local bool minor_collection_running = false;
+
+// Objects that live for the whole run outside the heap, such as the canonical objects created at load time.
+// The runtime treats them as any other object, the collector never marks nor moves them
+static _Thread_local memory_chunk static_area;
+
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
@@ -187,21 +240,157 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
+static void remember (remembered_set *set, size_t *p) {
+  if (set->size == set->capacity) {
+    set->capacity = set->capacity * 2 + 256;
+    set->items    = realloc(set->items, set->capacity * sizeof(size_t *));
+    if (set->items == NULL) {
+      perror("ERROR: remember: realloc failed\n");
+      exit(1);
+    }
+  }
+  set->items[set->size++] = p;
+}
+
+void gc_remember (void *field) {
+  // Stores into the stack, the globals or the static area need nothing, those are scanned or never point to the heap
+  if ((size_t *)field >= heap.begin && (size_t *)field < heap.current) {
+    remember(&remembered_fields, field);
+  }
+}
+
+static double now (void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+bool gc_configure_from_environment (void) {
+  const char *initial = getenv("LAMA_HEAP_INITIAL"), *max = getenv("LAMA_HEAP_MAX");
+  const char *ratio   = getenv("LAMA_GC_TIME_RATIO"), *threads = getenv("LAMA_GC_THREADS");
+  if (initial != NULL && (gc_config.initial_heap_size = gc_parse_size(initial)) == 0) { return false; }
+  if (max != NULL && (gc_config.max_heap_size = gc_parse_size(max)) == 0) { return false; }
+  if (ratio != NULL) {
+    char *end;
+    gc_config.gc_time_ratio = strtod(ratio, &end);
+    if (*ratio == '\0' || *end != '\0' || !(gc_config.gc_time_ratio > 0 && gc_config.gc_time_ratio < 1)) {
+      return false;
+    }
+  }
+  if (threads != NULL) {
+    char *end;
+    long  n = strtol(threads, &end, 10);
+    if (*threads == '\0' || *end != '\0' || n <= 0 || n > MAX_MARK_THREADS) { return false; }
+    gc_config.mark_threads = (int)n;
+  }
+  return true;
+}
+
+size_t gc_parse_size (const char *s) {
+  char              *end;
+  unsigned long long bytes = strtoull(s, &end, 10);
+  int                shift = 0;
+  if (end == s || *s == '-') { return 0; }
+  switch (*end) {
+    case 'K':
+    case 'k': shift = 10; end++; break;
+    case 'M':
+    case 'm': shift = 20; end++; break;
+    case 'G':
+    case 'g': shift = 30; end++; break;
+    default: break;
+  }
+  if (*end != '\0' || bytes == 0 || bytes > (WORDS_TO_BYTES(HEAP_RESERVED_SIZE) >> shift)) { return 0; }
+  return BYTES_TO_WORDS(bytes << shift);
+}
+
+/* The memory is not cleared: alloc_* write the header and the constructors of the runtime every field before the
+   collector may run again, alloc_string also the terminating zero */
 void *gc_alloc_on_existing_heap (size_t size) {
-  if (heap.current + size <= heap.end) {
+  if (size <= MAX_NURSERY_OBJECT_SIZE) {
+    if (gc_nursery.current + size <= gc_nursery.end) {
+      void *p = (void *)gc_nursery.current;
+      gc_nursery.current += size;
+      return p;
+    }
+    return NULL;
+  }
+  // A large object goes to the old generation directly, which keeps room for the promotion of a full nursery. Its
+  // fields are filled without the write barrier, so the next minor collection scans all of it
+  if (heap.current + size + gc_nursery.size <= heap.end) {
     void *p = (void *)heap.current;
     heap.current += size;
-    memset(p, 0, size * sizeof(size_t));
+    remember(&remembered_objects, p);
     return p;
   }
   return NULL;
 }
 
-void *gc_alloc (size_t size) {
-#ifdef DEBUG_PRINT
-  printf("Reallocation!\n");
+/* Copies a young object to the end of the old generation unless it is already there, returns its new address. The
+   forward address of a copied object points to the contents of the copy */
+static void *promote (void *obj) {
+  if (!gc_is_young(obj)) { return obj; }
+  data *d = TO_DATA(obj);
+  if (d->forward_address != 0) { return (void *)d->forward_address; }
+  size_t words = BYTES_TO_WORDS(obj_size_row_ptr(obj));
+  memcpy(heap.current, d, WORDS_TO_BYTES(words));
+  void *copy         = get_object_content_ptr(heap.current);
+  heap.current      += words;
+  d->forward_address = (ptrt)copy;
+  return copy;
+}
+
+static void promote_fields (void *header_ptr) {
+  for (obj_field_iterator it = ptr_field_begin_iterator(header_ptr); !field_is_done_iterator(&it);
+       obj_next_ptr_field_iterator(&it)) {
+    *(void **)it.cur_field = promote(*(void **)it.cur_field);
+  }
+}
+
+static void gc_root_scan_stack ();
+static void drain_mark_stack (void);
+static bool drain_mark_stack_in_parallel (void);
+#ifdef CHECK_PARALLEL_MARK
+static void check_parallel_mark (void);
 #endif
-  fflush(stdout);
+
+/* Cheney's copying collection of the nursery into the old generation. The roots are those of a major collection and
+   the remembered fields and objects, the promoted objects are scanned in the order they were copied. The caller
+   makes sure the old generation has room for the whole nursery */
+static void minor_collection (void) {
+  double  start            = now();
+  size_t *scan             = heap.current;
+  minor_collection_running = true;
+  gc_root_scan_stack();
+  for (int i = 0; i < extra_roots.current_free; i++) {
+    *extra_roots.roots[i] = promote(*extra_roots.roots[i]);
+  }
+#ifdef LAMA_ENV
+  for (size_t *ptr = (size_t *)&__start_custom_data; ptr < (size_t *)&__stop_custom_data; ++ptr) {
+    *(void **)ptr = promote(*(void **)ptr);
+  }
+#endif
+  for (size_t i = 0; i < remembered_fields.size; i++) {
+    *(void **)remembered_fields.items[i] = promote(*(void **)remembered_fields.items[i]);
+  }
+  for (size_t i = 0; i < remembered_objects.size; i++) {
+    promote_fields(remembered_objects.items[i]);
+  }
+  while (scan < heap.current) {
+    promote_fields(scan);
+    scan += BYTES_TO_WORDS(obj_size_header_ptr(scan));
+  }
+  minor_collection_running = false;
+  remembered_fields.size   = 0;
+  remembered_objects.size  = 0;
+  gc_nursery.current       = gc_nursery.begin;
+  gc_stats.collections++;
+  sizing.gc_time += now() - start;
+  gc_stats.time  += now() - start;
+}
+
+/* Mark-compact of the old generation, the nursery is empty */
+static void major_collection (size_t additional_size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
@@ -210,12 +399,18 @@ void *gc_alloc (size_t size) {
   FILE *heap_before  = print_objects_traversal("before-mark", 0);
   fclose(heap_before);
 #endif
+  sizing.major_start = now();
   mark_phase();
 #ifdef FULL_INVARIANT_CHECKS
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
-  compact_phase(size);
+  compact_phase(additional_size);
+  gc_stats.collections++;
+  gc_stats.major_collections++;
+  sizing.window_start = now();
+  sizing.gc_time      = 0;
+  gc_stats.time      += sizing.window_start - sizing.major_start;
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -238,10 +433,25 @@ void *gc_alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has finished\n");
 #endif
+}
+
+void *gc_alloc (size_t size) {
+#ifdef DEBUG_PRINT
+  printf("Reallocation!\n");
+#endif
+  fflush(stdout);
+  minor_collection();
+  // The old generation always has room for the promotion of a full nursery, and for the object if it is large
+  size_t required = gc_nursery.size + (size > MAX_NURSERY_OBJECT_SIZE ? size : 0);
+  if (heap.current + required > heap.end) { major_collection(required); }
   return gc_alloc_on_existing_heap(size);
 }
 
 static void gc_root_scan_stack () {
+  if (gc_scan_stack_hook != NULL) {
+    gc_scan_stack_hook();
+    return;
+  }
   for (size_t *p = (size_t *)(__gc_stack_top + sizeof(size_t)); p < (size_t *)__gc_stack_bottom; ++p) {
     gc_test_and_mark_root((size_t **)p);
   }
@@ -270,38 +480,127 @@ void mark_phase (void) {
 #endif
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "scan_global_area has finished\n");
+#endif
+  if (drain_mark_stack_in_parallel()) {
+#ifdef CHECK_PARALLEL_MARK
+    check_parallel_mark();
+#endif
+  } else {
+    drain_mark_stack();
+  }
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has finished\n");
 #endif
 }
 
-void compact_phase (size_t additional_size) {
-  size_t live_size = compute_locations();
-
-  // all in words
-  size_t next_heap_size =
-      MAX(live_size * EXTRA_ROOM_HEAP_COEFFICIENT + additional_size, MINIMUM_HEAP_CAPACITY);
-  size_t next_heap_pseudo_size = MAX(next_heap_size, heap.size);
+#ifdef CHECK_PARALLEL_MARK
+/* Marks the heap again alone after a parallel marking and fails unless both marked the same objects */
+static void check_parallel_mark (void) {
+  size_t objects = 0;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it); heap_next_obj_iterator(&it)) {
+    objects++;
+  }
+  bool  *marked = malloc(objects * sizeof(bool) + 1);
+  size_t i      = 0;
+  if (marked == NULL) {
+    perror("ERROR: check_parallel_mark: malloc failed\n");
+    exit(1);
+  }
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it); heap_next_obj_iterator(&it)) {
+    void *obj   = get_object_content_ptr(it.current);
+    marked[i++] = is_marked(obj);
+    unmark_object(obj);
+  }
+  gc_root_scan_stack();
+  scan_extra_roots();
+#ifdef LAMA_ENV
+  scan_global_area();
+#endif
+  drain_mark_stack();
+  i = 0;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it); heap_next_obj_iterator(&it)) {
+    void *obj = get_object_content_ptr(it.current);
+    if (marked[i++] != is_marked(obj)) {
+      failure("parallel marking %s the object at %p, sequential marking %s\n",
+              marked[i - 1] ? "marked" : "missed",
+              obj,
+              is_marked(obj) ? "marked it" : "did not");
+    }
+  }
+  free(marked);
+}
+#endif
 
-  memory_chunk old_heap = heap;
-  heap.begin            = mmap(NULL, WORDS_TO_BYTES(next_heap_pseudo_size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (heap.begin == MAP_FAILED) {
-    fprintf(stderr, "ERROR: mmap failed for size %zu: %s\n",
-            WORDS_TO_BYTES(next_heap_pseudo_size), strerror(errno));
+/* Makes the first words of the reserved range usable, whole pages of them, and releases the pages after them */
+static void resize_heap (size_t words) {
+  size_t page_words = BYTES_TO_WORDS(getpagesize());
+  words             = (words + page_words - 1) / page_words * page_words;
+  if (words > HEAP_RESERVED_SIZE) {
+    failure("the heap of %zu words exceeds the reserved %zu\n", words, (size_t)HEAP_RESERVED_SIZE);
+  }
+  if (words > heap.size && mprotect(heap.begin, WORDS_TO_BYTES(words), PROT_READ | PROT_WRITE) < 0) {
+    fprintf(stderr, "ERROR: mprotect failed for size %zu: %s\n", WORDS_TO_BYTES(words), strerror(errno));
+    exit(1);
+  }
+  if (words < heap.size
+      && mmap(heap.begin + words,
+              WORDS_TO_BYTES(heap.size - words),
+              PROT_NONE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+              -1,
+              0)
+             == MAP_FAILED) {
+    fprintf(stderr, "ERROR: mmap failed for size %zu: %s\n", WORDS_TO_BYTES(heap.size - words), strerror(errno));
     exit(1);
   }
-  memcpy(heap.begin, old_heap.begin, WORDS_TO_BYTES(old_heap.size));
-  heap.end     = heap.begin + next_heap_pseudo_size;
-  heap.size    = next_heap_pseudo_size;
-  heap.current = heap.begin + (old_heap.current - old_heap.begin);
+  heap.end  = heap.begin + words;
+  heap.size = words;
+}
+
+/* The old generation part of a heap size of gc_config, which counts the nursery */
+static size_t old_generation_size (size_t heap_size) {
+  return MAX(heap_size, MIN_HEAP_SIZE) - NURSERY_SIZE;
+}
+
+/* Adjusts the growth factor by the share of the time since the last major collection spent collecting, and returns
+   the size of the heap after this one */
+static size_t next_heap_size (size_t live_size, size_t additional_size) {
+  double t      = now();
+  double target = gc_config.gc_time_ratio;
+  double ratio  = (sizing.gc_time + t - sizing.major_start) / MAX(t - sizing.window_start, 1e-9);
+  if (ratio > target) {
+    sizing.factor = MIN(sizing.factor * MIN(ratio / target, 2.0), MAX_HEAP_GROWTH_FACTOR);
+  } else if (ratio < target / 2) {
+    sizing.factor = MAX(sizing.factor * 0.75, MIN_HEAP_GROWTH_FACTOR);
+  }
+  size_t required = live_size + additional_size, limit = old_generation_size(gc_config.max_heap_size);
+  if (required > limit) {
+    failure("the heap limit of %zu words is exceeded, the nursery takes %zu, %zu words are live in the old generation "
+            "and %zu more are needed\n",
+            gc_config.max_heap_size,
+            (size_t)NURSERY_SIZE,
+            live_size,
+            additional_size);
+  }
+  size_t size = (size_t)((double)live_size * sizing.factor) + additional_size;
+  return MIN(MAX(size, MAX(required, old_generation_size(gc_config.initial_heap_size))), limit);
+}
+
+void compact_phase (size_t additional_size) {
+  size_t live_size = compute_locations();
 
+  // Objects slide towards the beginning of the heap in place, the heap keeps its address
+  memory_chunk old_heap = heap;
   update_references(&old_heap);
   physically_relocate(&old_heap);
 
   heap.current = heap.begin + live_size;
-  if (munmap(old_heap.begin, WORDS_TO_BYTES(old_heap.size)) < 0) {
-      perror("ERROR: compact_phase: munmap failed\n");
-      exit(1);
-  }
+  resize_heap(next_heap_size(live_size, additional_size));
+}
+
+/* The contents of a live object after compaction, its forward address points to the header */
+static inline void *forwarded (void *obj) {
+  return (void *)get_forward_address(obj) + get_header_size(get_type_row_ptr(obj));
 }
 
 size_t compute_locations () {
@@ -335,15 +634,10 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
 #endif
   for (size_t *ptr = (size_t *)start; ptr < (size_t *)end; ++ptr) {
     size_t ptr_value = *ptr;
-    // this can't be expressed via is_valid_heap_pointer, because this pointer may point area corresponding to the old
-    // heap
+    // this can't be expressed via is_valid_heap_pointer, which also accepts the nursery
     if (is_valid_pointer((size_t *)ptr_value) && (size_t)old_heap->begin <= ptr_value
         && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+      *(void **)ptr = forwarded((void *)ptr_value);
     }
   }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
@@ -359,8 +653,8 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
     size_t *ptr       = (size_t *)extra_roots.roots[i];
     size_t  ptr_value = *ptr;
     if (!is_valid_pointer((size_t *)ptr_value)) { continue; }
-    // skip this one since it was already fixed from scanning the stack
-    if ((extra_roots.roots[i] >= (void **)__gc_stack_top
+    // skip this one since it was already fixed from scanning the stack, which starts right above __gc_stack_top
+    if ((extra_roots.roots[i] > (void **)__gc_stack_top
          && extra_roots.roots[i] < (void **)__gc_stack_bottom)
 #ifdef LAMA_ENV
         || (extra_roots.roots[i] <= (void **)&__stop_custom_data
@@ -403,11 +697,7 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
       continue;
     }
     if ((size_t)old_heap->begin <= ptr_value && ptr_value <= (size_t)old_heap->current) {
-      void *obj_ptr = (void *)heap.begin + ((void *)ptr_value - (void *)old_heap->begin);
-      void *new_addr =
-          (void *)heap.begin + ((void *)get_forward_address(obj_ptr) - (void *)old_heap->begin);
-      size_t content_offset = get_header_size(get_type_row_ptr(obj_ptr));
-      *(void **)ptr         = new_addr + content_offset;
+      *(void **)ptr = forwarded((void *)ptr_value);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr,
               "|\textra root (%p) %p -> %p\n",
@@ -435,19 +725,9 @@ void update_references (memory_chunk *old_heap) {
 
         size_t *field_value = *(size_t **)field_iter.cur_field;
         if (field_value < old_heap->begin || field_value > old_heap->current) { continue; }
-        // this pointer should also be modified according to old_heap->begin
-        void *field_obj_content_addr =
-            (void *)heap.begin + (*(void **)field_iter.cur_field - (void *)old_heap->begin);
-        // important, we calculate new_addr very carefully here, because objects may relocate to another memory chunk
-        void *new_addr =
-            heap.begin
-            + ((size_t *)get_forward_address(field_obj_content_addr) - (size_t *)old_heap->begin);
-        // update field reference to point to new_addr
-        // since, we want fields to point to an actual content, we need to add this extra content_offset
-        // because forward_address itself is a pointer to the object's header
-        size_t content_offset = get_header_size(get_type_row_ptr(field_obj_content_addr));
+        void *new_addr = forwarded(field_value);
 #ifdef DEBUG_VERSION
-        if (!is_valid_heap_pointer((void *)(new_addr + content_offset))) {
+        if (!is_valid_heap_pointer(new_addr)) {
 #  ifdef DEBUG_PRINT
           fprintf(stderr,
                   "ur: incorrect pointer assignment: on object with id %d",
@@ -456,13 +736,13 @@ void update_references (memory_chunk *old_heap) {
           exit(1);
         }
 #endif
-        *(void **)field_iter.cur_field = new_addr + content_offset;
+        *(void **)field_iter.cur_field = new_addr;
       }
     }
     heap_next_obj_iterator(&it);
   }
   // fix pointers from stack
-  scan_and_fix_region(old_heap, (void *)__gc_stack_top + sizeof(size_t), (void *)__gc_stack_bottom + sizeof(size_t));
+  scan_and_fix_region(old_heap, (void *)__gc_stack_top + sizeof(size_t), (void *)__gc_stack_bottom);
 
   // fix pointers from extra_roots
   scan_and_fix_region_roots(old_heap);
@@ -487,11 +767,12 @@ void physically_relocate (memory_chunk *old_heap) {
     heap_iterator next_iter = from_iter;
     heap_next_obj_iterator(&next_iter);
     if (is_marked(obj)) {
-      // Move the object from its old location to its new location relative to
-      // the heap's (possibly new) location, 'to' points to future object header
-      size_t *to = heap.begin + ((size_t *)get_forward_address(obj) - (size_t *)old_heap->begin);
+      // Slide the object down to its new location, 'to' points to future object header
+      size_t *to = (size_t *)get_forward_address(obj);
       memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
-      unmark_object(get_object_content_ptr(to));
+      // A live object has no forward address between collections, neither has its clone made by Lclone, which a
+      // minor collection would take for a promoted one
+      TO_DATA(get_object_content_ptr(to))->forward_address = 0;
     }
     from_iter = next_iter;
   }
@@ -501,60 +782,319 @@ void physically_relocate (memory_chunk *old_heap) {
 }
 
 inline bool is_valid_heap_pointer (const size_t *p) {
-  return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
+  return (!UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current) || gc_is_young(p);
+}
+
+bool is_valid_object_pointer (const size_t *p) {
+  return is_valid_heap_pointer(p)
+         || (!UNBOXED(p) && (size_t)static_area.begin <= (size_t)p && (size_t)p < (size_t)static_area.end);
+}
+
+void set_static_area (void *begin, void *end) {
+  static_area.begin   = begin;
+  static_area.end     = end;
+  static_area.current = end;
+  static_area.size    = (size_t *)end - (size_t *)begin;
 }
 
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
 
-static inline void queue_enqueue (heap_iterator *tail_iter, void *obj) {
-  void *tail         = tail_iter->current;
-  void *tail_content = get_object_content_ptr(tail);
-  set_forward_address(tail_content, (size_t)obj);
-  make_enqueued(obj);
-  heap_next_obj_iterator(tail_iter);
+static void grow_mark_stack (void) {
+  mark_stack.capacity = mark_stack.capacity * 2 + 1024;
+  mark_stack.items    = realloc(mark_stack.items, mark_stack.capacity * sizeof(void *));
+  if (mark_stack.items == NULL) {
+    perror("ERROR: grow_mark_stack: realloc failed\n");
+    exit(1);
+  }
 }
 
-static inline void *queue_dequeue (heap_iterator *head_iter) {
-  void *head         = head_iter->current;
-  void *head_content = get_object_content_ptr(head);
-  void *value        = (void *)get_forward_address(head_content);
-  make_dequeued(value);
-  heap_next_obj_iterator(head_iter);
-  return value;
+static inline void mark_stack_push (void *obj) {
+  if (mark_stack.size == mark_stack.capacity) { grow_mark_stack(); }
+  mark_stack.items[mark_stack.size++] = obj;
 }
 
-void mark (void *obj) {
-  if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
-
-  // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
-  // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
-  // iterator where we will write address of the element that is going to be enqueued
-  heap_iterator q_tail_iter = q_head_iter;
-  queue_enqueue(&q_tail_iter, obj);
-
-  // invariant: queue contains only objects that are valid heap pointers (each corresponding to content of unmarked
-  // object) also each object is in queue only once
-  while (q_head_iter.current != q_tail_iter.current) {
-    // while the queue is non-empty
-    void *cur_obj = queue_dequeue(&q_head_iter);
-    mark_object(cur_obj);
-    void *header_ptr = get_obj_header_ptr(cur_obj);
-    for (obj_field_iterator ptr_field_it = ptr_field_begin_iterator(header_ptr);
-         !field_is_done_iterator(&ptr_field_it);
-         obj_next_ptr_field_iterator(&ptr_field_it)) {
-      void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
-        continue;
-      }
-      // if we came to this point it must be true that field_value is unmarked and not currently in queue
-      // thus, we maintain the invariant
-      queue_enqueue(&q_tail_iter, field_value);
+/* Returns the number of fields of the object that may point to other objects and sets the first of them. The field
+   range is taken from the header word read once */
+static inline size_t pointer_fields (void *obj, void ***fields) {
+  auint  header = TO_DATA(obj)->data_header;
+  size_t len    = LEN(header);
+  *fields       = (void **)obj;
+  switch (TAG(header)) {
+    case ARRAY_TAG: return header & ARRAY_PACKED ? 0 : len;
+    // the fields follow the tag
+    case SEXP_TAG: ++*fields; return len;
+    // the fields follow the code offset
+    case CLOSURE_TAG: ++*fields; return len > 0 ? len - 1 : 0;
+    default: return 0;
+  }
+}
+
+/* Marks the object and pushes the heap objects its fields point to, the nursery is empty during a major collection */
+static inline void scan_object (void *obj) {
+  data *d = TO_DATA(obj);
+  if (GET_MARK_BIT(d->forward_address)) { return; }
+  SET_MARK_BIT(d->forward_address);
+  void **fields;
+  size_t len = pointer_fields(obj, &fields);
+  for (size_t i = 0; i < len; i++) {
+    size_t *field = fields[i];
+    if (!UNBOXED(field) && field >= heap.begin && field <= heap.current) { mark_stack_push(field); }
+  }
+}
+
+/* Marks everything reachable from the pushed objects. An object taken off the stack is prefetched and scanned only
+   after MARK_PREFETCH_DISTANCE more have been taken, so that its header arrives while the others are scanned */
+static void drain_mark_stack (void) {
+  void  *window[MARK_PREFETCH_DISTANCE];
+  size_t head = 0, count = 0;
+  while (true) {
+    while (count < MARK_PREFETCH_DISTANCE && mark_stack.size > 0) {
+      void *obj = mark_stack.items[--mark_stack.size];
+      __builtin_prefetch(TO_DATA(obj), 1);
+      window[(head + count++) % MARK_PREFETCH_DISTANCE] = obj;
+    }
+    if (count == 0) { return; }
+    void *obj = window[head];
+    head      = (head + 1) % MARK_PREFETCH_DISTANCE;
+    count--;
+    scan_object(obj);
+  }
+}
+
+// A work-stealing deque of objects to scan (Chase and Lev). The owner pushes and takes at the bottom, the other
+// workers steal at the top. A full buffer is replaced by one twice as large, the replaced ones are freed after the
+// marking, since a thief may still read them
+typedef struct mark_buffer {
+  size_t              capacity;
+  struct mark_buffer *replaced;
+  _Atomic(void *)     items[];
+} mark_buffer;
+
+typedef struct {
+  atomic_long           top, bottom;
+  _Atomic(mark_buffer *) buffer;
+} mark_deque;
+
+// The threads that help a major collection mark, shared by the heaps of all threads. The heap thread is worker 0 and
+// the helpers are workers 1 and on, a collection that finds them busy with another heap marks alone
+static struct {
+  pthread_mutex_t busy;         // held by the heap thread marking with the helpers
+  pthread_mutex_t lock;         // protects the fields below up to the deques
+  pthread_cond_t  wake, done;
+  int             helpers;      // helper threads started
+  int             workers;      // workers of the current round
+  int             finished;     // helpers done with it
+  unsigned long   round;
+  size_t         *heap_begin, *heap_end;
+  mark_deque      deques[MAX_MARK_THREADS];
+  atomic_int      active;       // workers that may still push objects
+} mark_pool = {.busy = PTHREAD_MUTEX_INITIALIZER, .lock = PTHREAD_MUTEX_INITIALIZER,
+               .wake = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER};
+
+static mark_buffer *new_mark_buffer (size_t capacity) {
+  mark_buffer *b = malloc(sizeof(mark_buffer) + capacity * sizeof(void *));
+  if (b == NULL) {
+    perror("ERROR: new_mark_buffer: malloc failed\n");
+    exit(1);
+  }
+  b->capacity = capacity;
+  b->replaced = NULL;
+  return b;
+}
+
+static void deque_push (mark_deque *q, void *obj) {
+  long         b   = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+  long         t   = atomic_load_explicit(&q->top, memory_order_acquire);
+  mark_buffer *buf = atomic_load_explicit(&q->buffer, memory_order_relaxed);
+  if (b - t >= (long)buf->capacity) {
+    mark_buffer *larger = new_mark_buffer(buf->capacity * 2);
+    for (long i = t; i < b; i++) {
+      atomic_store_explicit(&larger->items[i % larger->capacity],
+                            atomic_load_explicit(&buf->items[i % buf->capacity], memory_order_relaxed),
+                            memory_order_relaxed);
+    }
+    larger->replaced = buf;
+    atomic_store_explicit(&q->buffer, larger, memory_order_release);
+    buf = larger;
+  }
+  atomic_store_explicit(&buf->items[b % buf->capacity], obj, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+/* Takes the object pushed last by the owner, NULL if the deque is empty */
+static void *deque_take (mark_deque *q) {
+  long         b   = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+  mark_buffer *buf = atomic_load_explicit(&q->buffer, memory_order_relaxed);
+  atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long  t   = atomic_load_explicit(&q->top, memory_order_relaxed);
+  void *obj = NULL;
+  if (t <= b) {
+    obj = atomic_load_explicit(&buf->items[b % buf->capacity], memory_order_relaxed);
+    if (t < b) { return obj; }
+    // the last object, which a thief may be stealing
+    if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+      obj = NULL;
+    }
+  }
+  atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+  return obj;
+}
+
+/* Steals the object pushed first, NULL if the deque is empty or another worker took it first */
+static void *deque_steal (mark_deque *q) {
+  long t = atomic_load_explicit(&q->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+  if (t >= b) { return NULL; }
+  mark_buffer *buf = atomic_load_explicit(&q->buffer, memory_order_acquire);
+  void        *obj = atomic_load_explicit(&buf->items[t % buf->capacity], memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+  return obj;
+}
+
+static bool deque_is_empty (mark_deque *q) {
+  return atomic_load_explicit(&q->top, memory_order_acquire)
+         >= atomic_load_explicit(&q->bottom, memory_order_acquire);
+}
+
+/* scan_object of a worker: the mark bit is set atomically, so that every object is scanned by one worker */
+static inline void scan_object_shared (void *obj, mark_deque *own) {
+  data *d = TO_DATA(obj);
+  if (GET_MARK_BIT(__atomic_fetch_or(&d->forward_address, 1, __ATOMIC_RELAXED))) { return; }
+  void **fields;
+  size_t len = pointer_fields(obj, &fields);
+  for (size_t i = 0; i < len; i++) {
+    size_t *field = fields[i];
+    if (!UNBOXED(field) && field >= mark_pool.heap_begin && field <= mark_pool.heap_end) { deque_push(own, field); }
+  }
+}
+
+/* Steals from the other workers until it gets an object or all of them run out of work, then returns NULL. A worker
+   counts as active while it may push objects: it holds some or its deque is not empty. A thief becomes active before
+   it steals, so no worker sees none active while objects remain */
+static void *steal_work (int id) {
+  int workers = mark_pool.workers;
+  atomic_fetch_sub(&mark_pool.active, 1);
+  while (true) {
+    for (int k = 1; k < workers; k++) {
+      mark_deque *victim = &mark_pool.deques[(id + k) % workers];
+      if (deque_is_empty(victim)) { continue; }
+      atomic_fetch_add(&mark_pool.active, 1);
+      void *obj = deque_steal(victim);
+      if (obj != NULL) { return obj; }
+      atomic_fetch_sub(&mark_pool.active, 1);
     }
+    if (atomic_load(&mark_pool.active) == 0) { return NULL; }
+    sched_yield();
   }
 }
 
+/* drain_mark_stack of a worker over its deque, stealing when it is empty */
+static void mark_worker (int id) {
+  mark_deque *own = &mark_pool.deques[id];
+  void       *window[MARK_PREFETCH_DISTANCE];
+  size_t      head = 0, count = 0;
+  while (true) {
+    void *obj;
+    while (count < MARK_PREFETCH_DISTANCE && (obj = deque_take(own)) != NULL) {
+      __builtin_prefetch(TO_DATA(obj), 1);
+      window[(head + count++) % MARK_PREFETCH_DISTANCE] = obj;
+    }
+    if (count == 0) {
+      if ((obj = steal_work(id)) == NULL) { return; }
+      __builtin_prefetch(TO_DATA(obj), 1);
+      window[(head + count++) % MARK_PREFETCH_DISTANCE] = obj;
+      continue;
+    }
+    obj   = window[head];
+    head  = (head + 1) % MARK_PREFETCH_DISTANCE;
+    count--;
+    scan_object_shared(obj, own);
+  }
+}
+
+static void *mark_helper (void *arg) {
+  int           id   = (int)(intptr_t)arg;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&mark_pool.lock);
+  while (true) {
+    while (mark_pool.round == seen) { pthread_cond_wait(&mark_pool.wake, &mark_pool.lock); }
+    seen       = mark_pool.round;
+    bool works = id < mark_pool.workers;
+    pthread_mutex_unlock(&mark_pool.lock);
+    if (works) { mark_worker(id); }
+    pthread_mutex_lock(&mark_pool.lock);
+    if (works && ++mark_pool.finished == mark_pool.workers - 1) { pthread_cond_signal(&mark_pool.done); }
+  }
+  return NULL;
+}
+
+static int mark_threads (void) {
+  long n = gc_config.mark_threads > 0 ? gc_config.mark_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  return (int)MAX(1, MIN(n, MAX_MARK_THREADS));
+}
+
+/* Marks everything reachable from the pushed objects with the helpers, the pushed objects are dealt to the workers.
+   Returns false without marking if the heap is too small to be worth it or the helpers are busy */
+static bool drain_mark_stack_in_parallel (void) {
+  int workers = mark_threads();
+  if (workers == 1 || heap.current - heap.begin < PARALLEL_MARK_MIN_HEAP_SIZE
+      || pthread_mutex_trylock(&mark_pool.busy) != 0) {
+    return false;
+  }
+  pthread_mutex_lock(&mark_pool.lock);
+  while (mark_pool.helpers < workers - 1) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, mark_helper, (void *)(intptr_t)(mark_pool.helpers + 1)) != 0) { break; }
+    pthread_detach(thread);
+    mark_pool.helpers++;
+  }
+  workers = mark_pool.helpers + 1 < workers ? mark_pool.helpers + 1 : workers;
+  pthread_mutex_unlock(&mark_pool.lock);
+
+  for (int k = 0; k < workers; k++) {
+    mark_deque *q = &mark_pool.deques[k];
+    if (atomic_load(&q->buffer) == NULL) { atomic_store(&q->buffer, new_mark_buffer(1024)); }
+    atomic_store(&q->top, 0);
+    atomic_store(&q->bottom, 0);
+  }
+  for (size_t i = 0; i < mark_stack.size; i++) { deque_push(&mark_pool.deques[i % workers], mark_stack.items[i]); }
+  mark_stack.size      = 0;
+  mark_pool.heap_begin = heap.begin;
+  mark_pool.heap_end   = heap.current;
+  atomic_store(&mark_pool.active, workers);
+
+  pthread_mutex_lock(&mark_pool.lock);
+  mark_pool.workers  = workers;
+  mark_pool.finished = 0;
+  mark_pool.round++;
+  pthread_cond_broadcast(&mark_pool.wake);
+  pthread_mutex_unlock(&mark_pool.lock);
+  mark_worker(0);
+  pthread_mutex_lock(&mark_pool.lock);
+  while (mark_pool.finished < workers - 1) { pthread_cond_wait(&mark_pool.done, &mark_pool.lock); }
+  pthread_mutex_unlock(&mark_pool.lock);
+
+  for (int k = 0; k < workers; k++) {
+    mark_buffer *buf = atomic_load(&mark_pool.deques[k].buffer);
+    while (buf->replaced != NULL) {
+      mark_buffer *replaced = buf->replaced;
+      buf->replaced         = replaced->replaced;
+      free(replaced);
+    }
+  }
+  pthread_mutex_unlock(&mark_pool.busy);
+  return true;
+}
+
+void mark (void *obj) {
+  if (is_valid_heap_pointer(obj)) { mark_stack_push(obj); }
+}
+
 void scan_extra_roots (void) {
   for (int i = 0; i < extra_roots.current_free; ++i) {
     // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
@@ -580,6 +1120,10 @@ extern void gc_test_and_mark_root (size_t **root) {
           (void *)__gc_stack_top + 4,
           (void *)__gc_stack_bottom);
 #endif
+  if (minor_collection_running) {
+    *root = promote(*root);
+    return;
+  }
   mark((void *)*root);
 }
 
@@ -589,25 +1133,65 @@ void __gc_init (void) {
 }
 
 void __init (void) {
+  gc_init_process();
+  gc_init_thread();
+}
+
+void gc_init_process (void) {
   signal(SIGSEGV, handler);
-  size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
 
   srandom(time(NULL));
+}
 
-  heap.begin = mmap(
-      NULL, space_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+void gc_init_thread (void) {
+  // Only the address range is taken here, the heap grows by committing its pages and never moves
+  heap.begin = mmap(NULL,
+                    WORDS_TO_BYTES(HEAP_RESERVED_SIZE),
+                    PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1,
+                    0);
   if (heap.begin == MAP_FAILED) {
     perror("ERROR: __init: mmap failed\n");
     exit(1);
   }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
+  heap.size = 0;
+  gc_nursery.begin = mmap(
+      NULL, WORDS_TO_BYTES(NURSERY_SIZE), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (gc_nursery.begin == MAP_FAILED) {
+    perror("ERROR: __init: mmap failed\n");
+    exit(1);
+  }
+  gc_nursery.end  = gc_nursery.begin + NURSERY_SIZE;
+  gc_nursery.size = NURSERY_SIZE;
+  gc_reset();
+}
+
+void gc_reset (void) {
   heap.current = heap.begin;
+  // The old generation starts with what the nursery leaves of the initial size, at least room for the promotion of a
+  // full nursery, a previous run gives back the pages it grew by
+  resize_heap(old_generation_size(gc_config.initial_heap_size));
+  sizing.factor       = EXTRA_ROOM_HEAP_COEFFICIENT;
+  sizing.window_start = now();
+  sizing.gc_time      = 0;
+  gc_nursery.current  = gc_nursery.begin;
+  // A run that failed leaves them filled
+  remembered_fields.size   = 0;
+  remembered_objects.size  = 0;
+  mark_stack.size          = 0;
+  minor_collection_running = false;
   clear_extra_roots();
+  __gc_stack_top    = 0;
+  __gc_stack_bottom = 0;
+  // A run that failed leaves them set
+  gc_scan_stack_hook = NULL;
+  set_static_area(NULL, NULL);
 }
 
 extern void __shutdown (void) {
-  munmap(heap.begin, heap.size);
+  gc_reset();
+  munmap(heap.begin, WORDS_TO_BYTES(HEAP_RESERVED_SIZE));
 #ifdef DEBUG_VERSION
   cur_id = 0;
 #endif
@@ -615,8 +1199,8 @@ extern void __shutdown (void) {
   heap.end          = NULL;
   heap.size         = 0;
   heap.current      = NULL;
-  __gc_stack_top    = 0;
-  __gc_stack_bottom = 0;
+  munmap(gc_nursery.begin, WORDS_TO_BYTES(gc_nursery.size));
+  gc_nursery = (memory_chunk) {NULL, NULL, NULL, 0};
 }
 
 void clear_extra_roots (void) { extra_roots.current_free = 0; }
@@ -722,21 +1306,6 @@ void unmark_object (void *obj) {
   RESET_MARK_BIT(d->forward_address);
 }
 
-bool is_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  return IS_ENQUEUED(d->forward_address) != 0;
-}
-
-void make_enqueued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_ENQUEUED(d->forward_address);
-}
-
-void make_dequeued (void *obj) {
-  data *d = TO_DATA(obj);
-  MAKE_DEQUEUED(d->forward_address);
-}
-
 heap_iterator heap_begin_iterator () {
   heap_iterator it = {.current = heap.begin};
   return it;
@@ -839,6 +1408,11 @@ obj_field_iterator field_begin_iterator (void *obj) {
       it.cur_field += MEMBER_SIZE;
       break;
     }
+    case ARRAY: {
+      // Nothing to mark nor to fix up in a packed array
+      if (*(auint *)obj & ARRAY_PACKED) { it.cur_field = get_end_of_obj(it.obj_ptr); }
+      break;
+    }
     default: break;
   }
   return it;
@@ -894,6 +1468,7 @@ size_t get_header_size (lama_type type) {
 void *alloc_string (auint len) {
   data *obj        = alloc(string_size(len));
   obj->data_header = STRING_TAG | (len << 3);
+  obj->contents[len] = 0;
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "%p, [STRING] tag=%zu\n", obj, TAG(obj->data_header));
 #endif
@@ -7,13 +7,21 @@
 //      2. Compacting stage
 // Compacting is implemented in a very similar fashion to LISP2 algorithm,
 // which is well-known.
+// The heap is the old generation of a generational collector. Objects are
+// allocated in a fixed-size nursery, a full nursery is collected by copying
+// (Cheney) and its survivors are promoted to the end of the old generation.
+// The old generation is mark-compacted only when it has no room left for the
+// promotion of a full nursery. The roots of a minor collection include the
+// fields of old objects the write barrier recorded and the objects allocated
+// in the old generation since the last one.
 // Most important pieces of code to discover to understand how everything works:
 //  - void *gc_alloc (size_t): this function is basically called whenever we are
 // not able to allocate memory on the existing heap via simple bump allocator.
 //  - mark_phase(): this function will tell you everything you need to know
-// about marking. I would also recommend to pay attention to the fact that
-// marking is implemented without usage of any additional memory. Already
-// allocated space is sufficient (for details see 'void mark (void *obj)').
+// about marking. All roots are pushed onto a mark stack first, then a single
+// traversal drains it, prefetching the headers of the objects it is about to
+// scan (for details see 'drain_mark_stack'). A large heap is marked by a pool
+// of threads that steal work from each other ('drain_mark_stack_in_parallel').
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
 // functions used in there. It is basically an implementation of LISP2.
@@ -25,19 +33,41 @@
 
 #define GET_MARK_BIT(x) (((ptrt)(x)) & 1)
 #define SET_MARK_BIT(x) (x = (((ptrt)(x)) | 1))
-#define IS_ENQUEUED(x) (((ptrt)(x)) & 2)
-#define MAKE_ENQUEUED(x) (x = (((ptrt)(x)) | 2))
-#define MAKE_DEQUEUED(x) (x = (((ptrt)(x)) & (~2)))
 #define RESET_MARK_BIT(x) (x = (((ptrt)(x)) & (~1)))
-// since last 2 bits are used for mark-bit and enqueued-bit and due to correct
+// since last 2 bits are used for mark-bit and the bit of the debug traversal and due to correct
 // alignment we can expect that last 2 bits don't influence address (they
 // should always be zero)
 #define GET_FORWARD_ADDRESS(x) (((ptrt)(x)) & (~3))
 // take the last two bits as they are and make all others zero
 #define SET_FORWARD_ADDRESS(x, addr) (x = ((x & 3) | ((ptrt)(addr))))
-// if heap is full after gc shows in how many times it has to be extended
+// the size of the heap after a major collection over its live size: the initial value and the bounds the sizing
+// policy adjusts it within
 #define EXTRA_ROOM_HEAP_COEFFICIENT 2
+#define MIN_HEAP_GROWTH_FACTOR 1.5
+#define MAX_HEAP_GROWTH_FACTOR 16
 #define MINIMUM_HEAP_CAPACITY (64)
+// defaults of gc_config
+#define DEFAULT_INITIAL_HEAP_SIZE ((size_t)1 << 20)
+#define DEFAULT_GC_TIME_RATIO 0.05
+// words of the address range the heap may grow in
+#define HEAP_RESERVED_SIZE ((size_t)1 << 33)
+// words of the nursery
+#define NURSERY_SIZE (256 * 1024)
+// words of the smallest heap: the nursery and an old generation with room for the promotion of a full nursery
+#define MIN_HEAP_SIZE (NURSERY_SIZE + MINIMUM_HEAP_CAPACITY + NURSERY_SIZE)
+// larger objects are allocated in the old generation
+#define MAX_NURSERY_OBJECT_SIZE (NURSERY_SIZE / 8)
+// objects the marking has taken off the mark stack and prefetched but not scanned yet
+#define MARK_PREFETCH_DISTANCE 8
+// workers of a parallel marking, the heap thread included
+#define MAX_MARK_THREADS 64
+// words of the old generation below which a major collection marks alone. A build with CHECK_PARALLEL_MARK marks
+// every heap in parallel, then again alone, and fails if the two mark different objects
+#ifdef CHECK_PARALLEL_MARK
+#  define PARALLEL_MARK_MIN_HEAP_SIZE 0
+#else
+#  define PARALLEL_MARK_MIN_HEAP_SIZE ((size_t)1 << 20)
+#endif
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -54,6 +84,40 @@ typedef struct {
   void     *cur_field;
 } obj_field_iterator;
 
+// Counters reported by the interpreter's --stats output
+typedef struct {
+  size_t collections;         // number of completed GC cycles, minor and major
+  size_t major_collections;   // of them the ones that compacted the old generation
+  double time;                // seconds spent in them
+} gc_statistics;
+
+extern _Thread_local gc_statistics gc_stats;
+
+// Settings of the collector shared by the threads, sizes in words of the nursery and the old generation together, the
+// old generation gets what the nursery leaves of them. After a major collection the heap is sized to the live data
+// times a growth factor, which grows while the collections take more than gc_time_ratio of the run time since the
+// previous major collection and shrinks while they take less than half of it
+typedef struct {
+  size_t initial_heap_size;   // committed at start, the heap never shrinks below it
+  size_t max_heap_size;       // a run whose live data and requested object do not fit fails
+  double gc_time_ratio;
+  int    mark_threads;        // workers of the mark phase of a large heap, 0 for one per online processor
+} gc_settings;
+
+extern gc_settings gc_config;
+
+// takes the sizes from LAMA_HEAP_INITIAL and LAMA_HEAP_MAX, the ratio from LAMA_GC_TIME_RATIO and the mark threads from
+// LAMA_GC_THREADS, returns false if one of them is malformed
+bool gc_configure_from_environment (void);
+// parses a size in bytes with an optional K, M or G suffix into words, returns 0 if it is malformed
+size_t gc_parse_size (const char *s);
+
+// Marks the roots on the Lama stack instead of the conservative scan of every
+// word between __gc_stack_top and __gc_stack_bottom. The hook has to call
+// gc_test_and_mark_root for the live slots and overwrite the rest with
+// non-pointers, since compaction still fixes up every word of the stack
+extern _Thread_local void (*gc_scan_stack_hook) (void);
+
 // Memory pool for linear memory allocation
 typedef struct {
   size_t *begin;
@@ -62,6 +126,22 @@ typedef struct {
   size_t  size;
 } memory_chunk;
 
+extern _Thread_local memory_chunk gc_nursery;
+
+// the contents of an object follow its header, those of an empty one may end the nursery
+static inline bool gc_is_young (const void *p) {
+  return !UNBOXED(p) && (size_t *)p > gc_nursery.begin && (size_t *)p <= gc_nursery.current;
+}
+
+// records a field of an old object for the next minor collection
+void gc_remember (void *field);
+
+// Has to be called before a pointer is stored into a field of an existing object. A field that already holds a young
+// object has been recorded since the last minor collection
+static inline void gc_write_barrier (void *field, const void *value) {
+  if (gc_is_young(value) && !gc_is_young(field) && !gc_is_young(*(void **)field)) { gc_remember(field); }
+}
+
 // the only GC-related function that should be exposed, others are useful for tests and internal implementation
 // allocates object of the given size on the heap
 void *alloc(size_t);
@@ -71,6 +151,7 @@ void *gc_alloc(size_t);
 void *gc_alloc_on_existing_heap(size_t);
 
 // specific for mark-and-compact_phase gc
+// pushes a root onto the mark stack, mark_phase marks everything reachable from the pushed roots at its end
 void mark (void *obj);
 void mark_phase (void);
 // marks each pointer from extra roots
@@ -117,6 +198,16 @@ void __gc_init (void);
 // virtual stack, otherwise it is automatically invoked by `__gc_init`
 void __init (void);
 
+// the two parts of `__init`: the first installs the handler of SIGSEGV and
+// seeds random () for the whole process, the second reserves the heap and maps
+// the nursery of the calling thread
+void gc_init_process (void);
+void gc_init_thread (void);
+
+// empties the heap of the calling thread for the next run, releasing the pages
+// it grew by, and forgets the roots and the static area of the previous one
+void gc_reset (void);
+
 // mostly useful for tests but basically you want to call this in case you want
 // to deallocate all object allocated via GC
 extern void __shutdown (void);
@@ -126,6 +217,11 @@ extern void __shutdown (void);
 // ============================================================================
 extern void        gc_test_and_mark_root (size_t **root);
 bool               is_valid_heap_pointer (const size_t *);
+// a heap object or an object of the static area
+bool               is_valid_object_pointer (const size_t *);
+// registers the objects in [begin, end) that are never collected: the runtime accepts them as objects, the
+// collector ignores them
+void               set_static_area (void *begin, void *end);
 static inline bool is_valid_pointer (const size_t *);
 
 // ============================================================================
@@ -169,15 +265,6 @@ void mark_object (void *obj);
 // takes a pointer to an object content as an argument, marks the object as dead
 void unmark_object (void *obj);
 
-// takes a pointer to an object content as an argument, returns whether this object was enqueued to the queue (which is used in mark phase)
-bool is_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, marks object as enqueued
-void make_enqueued (void *obj);
-
-// takes a pointer to an object content as an argument, unmarks object as enqueued
-void make_dequeued (void *obj);
-
 // returns iterator to an object with the lowest address
 heap_iterator heap_begin_iterator ();
 void          heap_next_obj_iterator (heap_iterator *it);
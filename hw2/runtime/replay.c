@@ -0,0 +1,98 @@
+#include "replay.h"
+
+#include "runtime.h"
+
+static _Thread_local replay_mode mode = REPLAY_OFF;
+static _Thread_local FILE       *log_file = NULL;
+
+// random () shares one generator between threads, every thread seeds its own.
+// A state of 128 bytes is the one random () uses, so the sequences agree
+static _Thread_local struct random_data generator;
+static _Thread_local char               generator_state[128];
+
+static const char *const event_names[] = {"read", "line", "random", "time"};
+
+void replay_init (replay_mode m, const char *fname, unsigned int seed) {
+  mode = m;
+  switch (mode) {
+    case REPLAY_OFF: break;
+    case REPLAY_RECORD:
+      log_file = fopen(fname, "w");
+      if (log_file == NULL) { failure("cannot create replay log %s: %s\n", fname, strerror(errno)); }
+      fprintf(log_file, "seed %u\n", seed);
+      break;
+    case REPLAY_REPLAY:
+      log_file = fopen(fname, "r");
+      if (log_file == NULL) { failure("cannot open replay log %s: %s\n", fname, strerror(errno)); }
+      if (fscanf(log_file, " seed %u", &seed) != 1) { failure("replay log %s has no seed\n", fname); }
+      break;
+  }
+  memset(&generator, 0, sizeof(generator));
+  initstate_r(seed, generator_state, sizeof(generator_state), &generator);
+}
+
+aint replay_random (void) {
+  int32_t result;
+  random_r(&generator, &result);
+  return result;
+}
+
+void replay_finish (void) {
+  if (log_file != NULL) {
+    fclose(log_file);
+    log_file = NULL;
+  }
+  mode = REPLAY_OFF;
+}
+
+static void expect_event (replay_event event) {
+  char name[16];
+  if (fscanf(log_file, " %15s", name) != 1) {
+    failure("replay log is exhausted, expected '%s' event\n", event_names[event]);
+  }
+  if (strcmp(name, event_names[event]) != 0) {
+    failure("replay log diverged: expected '%s' event, found '%s'\n", event_names[event], name);
+  }
+}
+
+bool replay_take (replay_event event, aint *value) {
+  if (mode != REPLAY_REPLAY) { return false; }
+  expect_event(event);
+  if (fscanf(log_file, " %" SCNdAI, value) != 1) {
+    failure("replay log has malformed '%s' event\n", event_names[event]);
+  }
+  return true;
+}
+
+void replay_put (replay_event event, aint value) {
+  if (mode != REPLAY_RECORD) { return; }
+  fprintf(log_file, "%s %" PRIdAI "\n", event_names[event], value);
+}
+
+bool replay_take_line (char **line) {
+  if (mode != REPLAY_REPLAY) { return false; }
+  expect_event(EVENT_LINE);
+  long len;
+  if (fscanf(log_file, " %ld", &len) != 1) { failure("replay log has malformed 'line' event\n"); }
+  if (len < 0) {
+    *line = NULL;
+    return true;
+  }
+  // exactly one space separates the length from the line bytes
+  fgetc(log_file);
+  *line = malloc(len + 1);
+  if (*line == NULL || fread(*line, 1, len, log_file) != (size_t)len) {
+    failure("replay log has truncated 'line' event\n");
+  }
+  (*line)[len] = '\0';
+  return true;
+}
+
+void replay_put_line (const char *line) {
+  if (mode != REPLAY_RECORD) { return; }
+  if (line == NULL) {
+    fprintf(log_file, "line -1\n");
+  } else {
+    fprintf(log_file, "line %zu %s\n", strlen(line), line);
+  }
+}
@@ -0,0 +1,47 @@
+// ============================================================================
+//                        Input recording and replay
+// ============================================================================
+// Every value that makes two runs of the same program diverge (numbers and
+// lines read from stdin, random numbers and time) goes through this module.
+// In record mode such values are appended to a log file, in replay mode they
+// are taken from the log instead of their real source, so a replayed run
+// executes exactly the same path as the recorded one.
+//
+// The log is a text file with one event per line:
+//   seed <n>                  random seed of the recorded run, always first
+//   read <n>                  value returned by Lread
+//   line <len> <bytes>        line returned by LreadLine, len is -1 on EOF
+//   random <n>                value returned by Lrandom
+//   time <n>                  value returned by Ltime
+
+#ifndef __LAMA_REPLAY__
+#define __LAMA_REPLAY__
+
+#include "runtime_common.h"
+
+#include <stdbool.h>
+
+typedef enum { REPLAY_OFF, REPLAY_RECORD, REPLAY_REPLAY } replay_mode;
+
+typedef enum { EVENT_READ, EVENT_LINE, EVENT_RANDOM, EVENT_TIME } replay_event;
+
+// opens the log and seeds the random generator: with the given seed when
+// recording or running without a log, with the recorded one when replaying
+void replay_init (replay_mode mode, const char *fname, unsigned int seed);
+void replay_finish (void);
+
+// next number of the random generator of the calling thread, the same
+// sequence as random () after srandom with the seed of replay_init
+aint replay_random (void);
+
+// in replay mode stores the next logged value of the event into *value and
+// returns true, otherwise returns false and the caller computes the value
+bool replay_take (replay_event event, aint *value);
+// in record mode appends the value to the log
+void replay_put (replay_event event, aint value);
+
+// same for lines: *line is malloc'ed and NULL on EOF
+bool replay_take_line (char **line);
+void replay_put_line (const char *line);
+
+#endif
@@ -4,6 +4,7 @@
 
 # include "runtime.h"
 # include "gc.h"
+# include "replay.h"
 
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
@@ -17,7 +18,25 @@
   // assert(__builtin_frame_address(0) <= (void *)__gc_stack_top);                                    \
   if (flag) { __gc_stack_top = 0; }
 
+static _Thread_local FILE    *input_stream, *output_stream;
+static _Thread_local jmp_buf *failure_handler;
+
+#define INPUT (input_stream != NULL ? input_stream : stdin)
+#define OUTPUT (output_stream != NULL ? output_stream : stdout)
+
+void set_runtime_streams (FILE *input, FILE *output) {
+  input_stream  = input;
+  output_stream = output;
+}
+
+void set_failure_handler (jmp_buf *handler) { failure_handler = handler; }
+
 _Noreturn static void vfailure (char *s, va_list args) {
+  if (failure_handler != NULL) {
+    fprintf(OUTPUT, "*** FAILURE: ");
+    vfprintf(OUTPUT, s, args);
+    longjmp(*failure_handler, 1);
+  }
   fprintf(stderr, "*** FAILURE: ");
   vfprintf(stderr, s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
   exit(255);
@@ -56,7 +75,7 @@ void Lassert (void *f, char *s, ...) {
 extern void *Bsexp (aint* args, aint bn);
 extern aint   LtagHash (char *);
 
-void *global_sysargs;
+_Thread_local void *global_sysargs;
 
 // Gets a raw data_header
 extern aint LkindOf (void *p) {
@@ -242,7 +261,7 @@ extern aint LtagHash (char *s) {
 }
 
 char *de_hash (aint n) {
-  static char buf[MAX_SEXP_TAGLEN + 1] = {0, 0, 0, 0, 0, 0};
+  static _Thread_local char buf[MAX_SEXP_TAGLEN + 1] = {0, 0, 0, 0, 0, 0};
   char       *p      = (char *)BOX(NULL);
   p                  = &buf[MAX_SEXP_TAGLEN];
 
@@ -262,7 +281,7 @@ typedef struct {
   aint   len;
 } StringBuf;
 
-static StringBuf stringBuf;
+static _Thread_local StringBuf stringBuf;
 
 #define STRINGBUF_INIT 128
 
@@ -318,7 +337,7 @@ static void printValue (void *p) {
   if (UNBOXED(p)) {
     printStringBuf("%ld", UNBOX(p));
   } else {
-    if (!is_valid_heap_pointer(p)) {
+    if (!is_valid_object_pointer(p)) {
       printStringBuf("0x%x", p);
       return;
     }
@@ -567,7 +586,7 @@ aint inner_hash (aint depth, auint acc, void *p) {
   if (depth > HASH_DEPTH) return acc;
 
   if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer(p)) {
+  else if (is_valid_object_pointer(p)) {
     data *a = TO_DATA(p);
     aint  t = TAG(a->data_header), l = LEN(a->data_header), i;
 
@@ -640,8 +659,8 @@ extern aint Lcompare (void *p, void *q) {
     else return BOX(-1);
   } else if (UNBOXED(q)) return BOX(1);
   else {
-    if (is_valid_heap_pointer(p)) {
-      if (is_valid_heap_pointer(q)) {
+    if (is_valid_object_pointer(p)) {
+      if (is_valid_object_pointer(q)) {
         data *a = TO_DATA(p), *b = TO_DATA(q);
         aint   ta = TAG(a->data_header), tb = TAG(b->data_header);
         aint   la = LEN(a->data_header), lb = LEN(b->data_header);
@@ -682,7 +701,7 @@ extern aint Lcompare (void *p, void *q) {
         }
         return BOX(0);
       } else return BOX(-1);
-    } else if (is_valid_heap_pointer(q)) return BOX(1);
+    } else if (is_valid_object_pointer(q)) return BOX(1);
     else return BOX(p - q);
   }
 }
@@ -713,6 +732,7 @@ extern void *LmakeArray (aint length) {
 
   n = UNBOX(length);
   r = (data *)alloc_array(n);
+  r->data_header |= ARRAY_PACKED;
 
   p = (aint *)r->contents;
   while (n--) *p++ = BOX(0);
@@ -731,6 +751,7 @@ extern void *LmakeString (aint length) {
   PRE_GC();
 
   r = (data *)alloc_string(n);   // '\0' in the end of the string is taken into account
+  memset(r->contents, 0, n);
 
   POST_GC();
 
@@ -744,10 +765,9 @@ extern void *Bstring (aint* args/*void *p*/) {
   PRE_GC();
 
   push_extra_root((void**)&args[0]);
-  s = LmakeString(BOX(n));
+  s = ((data *)alloc_string(n))->contents;
   pop_extra_root((void**)&args[0]);
-  char *s_contents = (char *)&TO_DATA(s)->contents;
-  strncpy(s_contents, (char*)args[0], n + 1);   // +1 because of '\0' in the end of C-strings
+  memcpy(s, (char*)args[0], n);   // alloc_string writes the '\0' in the end
 
   POST_GC();
 
@@ -834,9 +854,12 @@ extern void *Barray (aint* args, aint bn) {
 
   r = (data *)alloc_array(n);
 
+  auint packed = ARRAY_PACKED;
   for (int i = 0; i < n; i++) {
     ((aint *)r->contents)[i] = args[i];
+    if (!UNBOXED(args[i])) packed = 0;
   }
+  r->data_header |= packed;
 
   for (aint i = n - 1; i >= 0; --i) {
     pop_extra_root((void**)&args[i]);
@@ -858,9 +881,12 @@ extern void *Barray_reversed (aint* args, aint bn) {
 
   r = (data *)alloc_array(n);
 
+  auint packed = ARRAY_PACKED;
   for (aint i = n - 1; i >= 0; --i) {
     ((auint *)r->contents)[n - 1 - i] = args[i];
+    if (!UNBOXED(args[i])) packed = 0;
   }
+  r->data_header |= packed;
 
   for (aint i = 0; i < n; i++) {
     pop_extra_root((void**)&args[i]);
@@ -871,7 +897,7 @@ extern void *Barray_reversed (aint* args, aint bn) {
 }
 
 #ifdef DEBUG_VERSION
-extern memory_chunk heap;
+extern _Thread_local memory_chunk heap;
 #endif
 
 extern void *Bsexp (aint* args, aint bn) {
@@ -1012,14 +1038,19 @@ extern void *Bsta (void *x, aint i, void *v) {
         break;
       }
       case SEXP_TAG: {
+        gc_write_barrier(&((aint *)((sexp *)d)->contents)[UNBOX(i)], v);
         ((aint *)((sexp *)d)->contents)[UNBOX(i)] = (aint)v;
         break;
       }
       default: {
+        if (!UNBOXED(v)) d->data_header &= ~ARRAY_PACKED;
+        gc_write_barrier(&((aint *)x)[UNBOX(i)], v);
         ((aint *)x)[UNBOX(i)] = (aint)v;
       }
     }
   } else {
+    // The reference may be a captured variable
+    gc_write_barrier(x, v);
     *(void **)x = v;
   }
 
@@ -1120,9 +1151,9 @@ extern void Lprintf (char *s, ...) {
     va_start(args, s);
     fix_unboxed(s, args);
 
-    if (vprintf(s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
+    if (vfprintf(OUTPUT, s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
 
-    fflush(stdout);
+    fflush(OUTPUT);
 }
 
 extern void *Lsprintf (char *fmt, ...) {
@@ -1199,9 +1230,9 @@ extern void Bprintf (char *s, ...) {
 
     va_start(args, s);
 
-    if (vprintf(s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
+    if (vfprintf(OUTPUT, s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
 
-    fflush(stdout);
+    fflush(OUTPUT);
 }
 
 extern void Bfprintf (FILE *f, char *s, ...) {
@@ -1241,17 +1272,26 @@ extern void Lfclose (FILE *f) {
 extern void *LreadLine () {
   char *buf;
 
-  if (scanf("%m[^\n]", &buf) == 1) {
+  if (replay_take_line(&buf)) {
+    if (buf == NULL) return (void *)BOX(0);
     void *s = Bstring((aint*)&buf);
+    free(buf);
+    return s;
+  }
 
-    getchar();
+  if (fscanf(INPUT, "%m[^\n]", &buf) == 1) {
+    void *s = Bstring((aint*)&buf);
 
+    getc(INPUT);
+
+    replay_put_line(buf);
     free(buf);
     return s;
   }
 
   if (errno != 0) failure("readLine (): %s\n", strerror(errno));
 
+  replay_put_line(NULL);
   return (void *)BOX(0);
 }
 
@@ -1319,9 +1359,12 @@ extern aint Lread () {
   // int result = BOX(0);
   aint result = BOX(0);
 
-  printf("> ");
-  fflush(stdout);
-  scanf("%" SCNdAI, &result);
+  fprintf(OUTPUT, "> ");
+  fflush(OUTPUT);
+  if (!replay_take(EVENT_READ, &result)) {
+    fscanf(INPUT, "%" SCNdAI, &result);
+    replay_put(EVENT_READ, result);
+  }
 
   return BOX(result);
 }
@@ -1338,8 +1381,8 @@ extern int Lbinoperror2 (void) {
 
 /* Lwrite is an implementation of the "write" construct */
 extern aint Lwrite (aint n) {
-  printf("%" PRIdAI "\n", UNBOX(n));
-  fflush(stdout);
+  fprintf(OUTPUT, "%" PRIdAI "\n", UNBOX(n));
+  fflush(OUTPUT);
 
   return 0;
 }
@@ -1349,15 +1392,26 @@ extern aint Lrandom (aint n) {
 
   if (UNBOX(n) <= 0) { failure("invalid range in random: %ld\n", UNBOX(n)); }
 
-  return BOX(random() % UNBOX(n));
+  aint result;
+  if (!replay_take(EVENT_RANDOM, &result)) {
+    result = replay_random() % UNBOX(n);
+    replay_put(EVENT_RANDOM, result);
+  }
+
+  return BOX(result);
 }
 
 extern aint Ltime () {
   struct timespec t;
 
-  clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+  aint result;
+  if (!replay_take(EVENT_TIME, &result)) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+    result = t.tv_sec * 1000000 + t.tv_nsec / 1000;
+    replay_put(EVENT_TIME, result);
+  }
 
-  return BOX(t.tv_sec * 1000000 + t.tv_nsec / 1000);
+  return BOX(result);
 }
 
 extern void set_args (aint argc, char *argv[]) {
@@ -1371,7 +1425,8 @@ extern void set_args (aint argc, char *argv[]) {
   push_extra_root((void **)&p);
 
   for (i = 0; i < n; i++) {
-    ((aint *)p)[i] = (aint)Bstring((aint*)&argv[i]);
+    void *arg = Bstring((aint*)&argv[i]);
+    Bsta(p, BOX(i), arg);
   }
 
   pop_extra_root((void **)&p);
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <regex.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +18,13 @@
 #define WORD_SIZE (CHAR_BIT * sizeof(ptrt))
 
 _Noreturn void failure (char *s, ...);
+
+// Streams of read, write, readLine and printf in the calling thread, stdin and stdout while NULL
+void set_runtime_streams (FILE *input, FILE *output);
+
+// With a handler set, a failure in the calling thread is reported to its output stream and jumps to the
+// handler instead of exiting the process
+void set_failure_handler (jmp_buf *handler);
 //
 // // Functional synonym for built-in operator ":";
 // void *Ls__Infix_58 (void** args);
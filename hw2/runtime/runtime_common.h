@@ -8,7 +8,7 @@
 // #define DEBUG_VERSION
 //#define FULL_INVARIANT_CHECKS
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern _Thread_local size_t __gc_stack_top, __gc_stack_bottom;
 
 #if defined(__x86_64__) || defined(__ppc64__)
 #define X86_64
@@ -33,10 +33,15 @@ typedef uint32_t auint;  // adaptive unsigned int
 #define SEXP_TAG 0x00000005
 #define CLOSURE_TAG 0x00000007
 #define UNBOXED_TAG 0x00000009   // Not actually a data_header; used to return from LkindOf
+// Storage strategy of an array, set while every element is an unboxed integer. The elements look the same
+// either way, but the collector neither marks through nor fixes up a packed array. Bsta clears the bit on
+// the first store of a boxed value
 #ifdef X86_64
-#define LEN_MASK (UINT64_MAX^7)
+#define ARRAY_PACKED ((auint)1 << 63)
+#define LEN_MASK (UINT64_MAX^7^ARRAY_PACKED)
 #else
-#define LEN_MASK (UINT32_MAX^7)
+#define ARRAY_PACKED ((auint)1 << 31)
+#define LEN_MASK (UINT32_MAX^7^ARRAY_PACKED)
 #endif
 #define LEN(x) (ptrt)(((ptrt)x & LEN_MASK) >> 3)
 #define TAG(x) (x & 7)
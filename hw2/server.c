@@ -0,0 +1,124 @@
+//
+// Pre-forked worker server, see server.h
+//
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "runtime.h"
+
+// Longest first line of a request
+#define REQUEST_NAME_MAX 4096
+
+/* Reads the first line of the request byte by byte, so that nothing of the program input is consumed */
+static int read_name(const int conn, char *name) {
+  int length = 0;
+  while (length < REQUEST_NAME_MAX - 1) {
+    char c;
+    const ssize_t n = read(conn, &c, 1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0 || c == '\n') break;
+    name[length++] = c;
+  }
+  if (length > 0 && name[length - 1] == '\r') length--;
+  name[length] = '\0';
+  return length;
+}
+
+static int find_file(const char *name, const int files_num, char *const *names) {
+  if (name[0] == '\0') return 0;
+  for (int k = 0; k < files_num; k++) {
+    const char *base = strrchr(names[k], '/');
+    if (strcmp(name, names[k]) == 0 || (base != NULL && strcmp(name, base + 1) == 0)) return k;
+  }
+  return -1;
+}
+
+/* Waits for a single request, runs it and exits */
+static _Noreturn void work(const int listener, const int files_num, char *const *names, const serve_function run) {
+  // Workers must not outlive the server
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  int conn;
+  while ((conn = accept(listener, NULL, NULL)) < 0) {
+    if (errno != EINTR) {
+      failure("Failed to accept a request: %s\n", strerror(errno));
+    }
+  }
+  close(listener);
+  char name[REQUEST_NAME_MAX];
+  read_name(conn, name);
+  const int file = find_file(name, files_num, names);
+  if (file < 0) {
+    dprintf(conn, "Unknown file %s\n", name);
+    exit(1);
+  }
+  if (dup2(conn, STDIN_FILENO) < 0 || dup2(conn, STDOUT_FILENO) < 0) {
+    failure("Failed to redirect the request: %s\n", strerror(errno));
+  }
+  close(conn);
+  run(file);
+  fflush(stdout);
+  exit(0);
+}
+
+static pid_t spawn(const int listener, const int files_num, char *const *names, const serve_function run) {
+  // Whatever the server buffered must not be written again by the worker
+  fflush(stdout);
+  fflush(stderr);
+  const pid_t pid = fork();
+  if (pid < 0) {
+    failure("Failed to start a worker: %s\n", strerror(errno));
+  }
+  if (pid == 0) {
+    work(listener, files_num, names, run);
+  }
+  return pid;
+}
+
+int listen_on(const char *socket_path) {
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    failure("Socket path %s is too long\n", socket_path);
+  }
+  strcpy(address.sun_path, socket_path);
+  const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    failure("Failed to create a socket: %s\n", strerror(errno));
+  }
+  unlink(socket_path);
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+    failure("Failed to listen on %s: %s\n", socket_path, strerror(errno));
+  }
+  return listener;
+}
+
+_Noreturn void serve(const char *socket_path, const int workers, const int files_num, char *const *names,
+                     const serve_function run) {
+  const int listener = listen_on(socket_path);
+  for (int k = 0; k < workers; k++) {
+    spawn(listener, files_num, names, run);
+  }
+  fprintf(stderr, "Serving %d file(s) on %s with %d workers\n", files_num, socket_path, workers);
+  // Every worker serves one request, a new one takes its place as soon as it exits
+  while (1) {
+    int status;
+    const pid_t pid = wait(&status);
+    if (pid < 0) {
+      if (errno == EINTR) continue;
+      failure("Failed to wait for a worker: %s\n", strerror(errno));
+    }
+    if (WIFSIGNALED(status) && WTERMSIG(status) != SIGPIPE) {
+      fprintf(stderr, "Worker %d was killed by signal %d\n", pid, WTERMSIG(status));
+    }
+    spawn(listener, files_num, names, run);
+  }
+}
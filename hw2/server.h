@@ -0,0 +1,24 @@
+//
+// Server mode: the bytecode files are loaded and prepared once, then every
+// request on a local Unix socket runs one of them in a pre-forked worker
+// process whose stdin and stdout are the connection.
+//
+// A request starts with a line naming the file, as given on the command line
+// or by its base name, an empty line selects the first one. The rest of the
+// connection is the input of the program, its output is sent back until the
+// worker closes the connection.
+//
+
+#ifndef HW2_SERVER_H
+#define HW2_SERVER_H
+
+// Runs the file with the given index in a worker, stdin and stdout are already the connection
+typedef void (*serve_function)(int file);
+
+/* Creates the socket, replacing a stale one, and listens on it */
+int listen_on(const char *socket_path);
+
+/* Listens on the socket and keeps the given number of workers waiting for requests, never returns */
+_Noreturn void serve(const char *socket_path, int workers, int files_num, char *const *names, serve_function run);
+
+#endif //HW2_SERVER_H
@@ -0,0 +1,148 @@
+//
+// Liveness analysis of arguments and locals producing precise GC stack maps
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stackmap.h"
+#include "runtime.h"
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+/* Returns the variable index of an argument or a local, -1 for globals and captured variables */
+static int variable(const function *f, const unsigned char designation, const int index) {
+  switch (designation) {
+    case ARG:
+      return index >= 0 && index < f->args_num ? index : -1;
+    case LOCAL:
+      return index >= 0 && index < f->locals_num ? f->args_num + index : -1;
+    default:
+      return -1;
+  }
+}
+
+static void set_bit(uint64_t *set, const int var) {
+  if (var >= 0) set[var / 64] |= (uint64_t) 1 << (var % 64);
+}
+
+static void clear_bit(uint64_t *set, const int var) {
+  if (var >= 0) set[var / 64] &= ~((uint64_t) 1 << (var % 64));
+}
+
+/* The frame may be suspended in the collector after these instructions */
+static bool is_gc_point(const instruction *i) {
+  switch (i->h) {
+    case CONST:
+      return i->l == CONST_STRING || i->l == MAKE_SEXP;
+    case CONTROL:
+      return i->l == MAKE_CLOSURE || i->l == CALL || i->l == CALLC;
+    case BUILTIN:
+      return i->l == BUILTIN_Lstring || i->l == BUILTIN_Barray;
+    default:
+      return false;
+  }
+}
+
+/* in = use + (out - def) */
+static void transfer(const function *f, const instruction *i, const uint64_t *out, uint64_t *in, const int words) {
+  memcpy(in, out, words * sizeof(uint64_t));
+  switch (i->h) {
+    case ST:
+      clear_bit(in, variable(f, i->l, i->args[0]));
+      break;
+    case LD:
+    case LDA:
+      set_bit(in, variable(f, i->l, i->args[0]));
+      break;
+    case CONTROL:
+      if (i->l == MAKE_CLOSURE) {
+        for (int k = 0; k < i->args[1]; k++) {
+          unsigned char designation;
+          int index;
+          closure_capture(i, k, &designation, &index);
+          set_bit(in, variable(f, designation, index));
+        }
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+static void analyze_function(const program *p, const function *f, stack_maps *maps, int *position) {
+  const int words = (f->args_num + f->locals_num + 63) / 64;
+  if (words == 0) return;
+  uint64_t *live_in = checked_calloc((size_t) f->insns_num * words, sizeof(uint64_t));
+  uint64_t *out = checked_calloc(words, sizeof(uint64_t));
+  uint64_t *in = checked_calloc(words, sizeof(uint64_t));
+  for (int k = 0; k < f->insns_num; k++) {
+    position[f->insns[k]] = k;
+  }
+
+  // Backward dataflow to a fixed point, visiting instructions in reverse code order
+  bool changed;
+  do {
+    changed = false;
+    for (int k = f->insns_num - 1; k >= 0; k--) {
+      const int insn = f->insns[k];
+      int succ[2];
+      const int n = instruction_successors(p, insn, succ);
+      memset(out, 0, words * sizeof(uint64_t));
+      for (int s = 0; s < n; s++) {
+        const uint64_t *succ_in = &live_in[(size_t) position[succ[s]] * words];
+        for (int w = 0; w < words; w++) out[w] |= succ_in[w];
+      }
+      transfer(f, &p->insns[insn], out, in, words);
+      uint64_t *old = &live_in[(size_t) k * words];
+      if (memcmp(old, in, words * sizeof(uint64_t)) != 0) {
+        memcpy(old, in, words * sizeof(uint64_t));
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  // A frame suspended after a GC point resumes at the next instruction, so its map is the live-out set
+  for (int k = 0; k < f->insns_num; k++) {
+    const int insn = f->insns[k];
+    const instruction *i = &p->insns[insn];
+    if (!is_gc_point(i)) continue;
+    uint64_t *map = checked_calloc(words, sizeof(uint64_t));
+    int succ[2];
+    const int n = instruction_successors(p, insn, succ);
+    for (int s = 0; s < n; s++) {
+      const uint64_t *succ_in = &live_in[(size_t) position[succ[s]] * words];
+      for (int w = 0; w < words; w++) map[w] |= succ_in[w];
+    }
+    maps->live[i->next] = map;
+  }
+  free(in);
+  free(out);
+  free(live_in);
+}
+
+stack_maps *build_stack_maps(const program *p) {
+  stack_maps *maps = checked_calloc(1, sizeof(stack_maps));
+  maps->code_size = p->bf->code_size;
+  maps->live = checked_calloc(maps->code_size, sizeof(uint64_t *));
+  int *position = checked_calloc(p->insns_num, sizeof(int));
+  for (int f = 0; f < p->functions_num; f++) {
+    analyze_function(p, &p->functions[f], maps, position);
+  }
+  free(position);
+  return maps;
+}
+
+void free_stack_maps(stack_maps *maps) {
+  for (unsigned long i = 0; i < maps->code_size; i++) {
+    free(maps->live[i]);
+  }
+  free(maps->live);
+  free(maps);
+}
@@ -0,0 +1,37 @@
+//
+// Precise GC stack maps. For every point where a frame may be suspended
+// while the collector runs (right after an allocating instruction and at
+// return addresses of calls) a stack map records which arguments and locals
+// of the frame may still be read. The collector marks only those slots and
+// clears the others, so dead references no longer keep garbage alive.
+//
+
+#ifndef HW2_STACKMAP_H
+#define HW2_STACKMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "analysis.h"
+
+struct stack_maps {
+  uint64_t **live;              // Code offset -> live variables bitset or NULL if the offset is not a GC point.
+                                // Bit i stands for argument i, bit args_num + i for local i
+  unsigned long code_size;
+};
+
+/* Runs the liveness analysis over every function of the program */
+stack_maps *build_stack_maps(const program *p);
+
+void free_stack_maps(stack_maps *maps);
+
+/* Returns the stack map of the frame suspended at the code offset or NULL if it is unknown */
+static inline const uint64_t *stack_map_at(const stack_maps *maps, const unsigned long offset) {
+  return offset < maps->code_size ? maps->live[offset] : NULL;
+}
+
+static inline bool stack_map_is_live(const uint64_t *map, const int var) {
+  return (map[var / 64] >> (var % 64)) & 1;
+}
+
+#endif //HW2_STACKMAP_H
@@ -0,0 +1,246 @@
+//
+// Inference of unboxed integer values over the bytecode
+//
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "runtime.h"
+
+// The abstract state before an instruction: a bit per argument, local and operand stack position that holds an
+// integer, and for every position the argument or local it was loaded from and not stored to since, or -1.
+// Arithmetic checks its operands, so the variables they were loaded from are integers after it
+typedef struct {
+  uint64_t *ints;
+  int *origin;
+} state;
+
+typedef struct {
+  const program *p;
+  const function *f;
+  int vars;                     // Arguments and locals
+  int words;
+  int depth;
+} context;
+
+static void *checked_calloc(const size_t n, const size_t size) {
+  void *p = calloc(n == 0 ? 1 : n, size);
+  if (p == NULL) {
+    failure("*** FAILURE: unable to allocate memory.\n");
+  }
+  return p;
+}
+
+static bool is_int(const state *s, const int slot) {
+  return (s->ints[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void set_int(const state *s, const int slot, const bool value) {
+  if (value) {
+    s->ints[slot / 64] |= (uint64_t) 1 << (slot % 64);
+  } else {
+    s->ints[slot / 64] &= ~((uint64_t) 1 << (slot % 64));
+  }
+}
+
+/* Returns the variable index of an argument or a local, -1 for globals and captured variables */
+static int variable(const function *f, const unsigned char designation, const int index) {
+  switch (designation) {
+    case ARG:
+      return index >= 0 && index < f->args_num ? index : -1;
+    case LOCAL:
+      return index >= 0 && index < f->locals_num ? f->args_num + index : -1;
+    default:
+      return -1;
+  }
+}
+
+static void push(const context *c, const state *s, int *depth, const bool is_integer, const int origin) {
+  set_int(s, c->vars + *depth, is_integer);
+  s->origin[*depth] = origin;
+  (*depth)++;
+}
+
+/* Both operands were checked to be integers, and so were the variables holding them */
+static void refine(const context *c, const state *s, const int depth, const int position) {
+  const int var = s->origin[position];
+  if (var < 0) return;
+  set_int(s, var, true);
+  for (int k = 0; k < depth; k++) {
+    if (s->origin[k] == var) set_int(s, c->vars + k, true);
+  }
+}
+
+/* Computes the state after the instruction in place */
+static void transfer(const context *c, const instruction *i, const state *s, int depth) {
+  int pops, pushes;
+  instruction_stack_effect(i, &pops, &pushes);
+  switch (i->h) {
+    case BINOP: {
+      const unsigned char op = i->l - 1;
+      // All operators but == and - assert that both operands are unboxed
+      if (op != 1 && op != 9) {
+        refine(c, s, depth, depth - 2);
+        refine(c, s, depth, depth - 1);
+      }
+      depth -= 2;
+      push(c, s, &depth, true, -1);
+      return;
+    }
+    case LD: {
+      const int var = variable(c->f, i->l, i->args[0]);
+      push(c, s, &depth, var >= 0 && is_int(s, var), var);
+      return;
+    }
+    case ST: {
+      const int var = variable(c->f, i->l, i->args[0]);
+      if (var < 0) return;
+      set_int(s, var, is_int(s, c->vars + depth - 1));
+      for (int k = 0; k < depth; k++) {
+        if (s->origin[k] == var) s->origin[k] = -1;
+      }
+      s->origin[depth - 1] = var;
+      return;
+    }
+    case CONST:
+      switch (i->l) {
+        case CONST_INT:
+          push(c, s, &depth, true, -1);
+          return;
+        case DUP:
+          push(c, s, &depth, is_int(s, c->vars + depth - 1), s->origin[depth - 1]);
+          return;
+        case SWAP: {
+          const bool a = is_int(s, c->vars + depth - 2);
+          const int origin = s->origin[depth - 2];
+          set_int(s, c->vars + depth - 2, is_int(s, c->vars + depth - 1));
+          s->origin[depth - 2] = s->origin[depth - 1];
+          set_int(s, c->vars + depth - 1, a);
+          s->origin[depth - 1] = origin;
+          return;
+        }
+        default:
+          break;
+      }
+      break;
+    case CONTROL:
+      if (i->l == BEGIN || i->l == CBEGIN) {
+        // Locals start as BOX(0)
+        for (int k = 0; k < c->vars; k++) {
+          set_int(s, k, k >= c->f->args_num);
+        }
+        return;
+      }
+      if (i->l == TAG || i->l == MAKE_ARRAY) {
+        depth--;
+        push(c, s, &depth, true, -1);
+        return;
+      }
+      break;
+    case PATT:
+      depth -= pops;
+      push(c, s, &depth, true, -1);
+      return;
+    case BUILTIN:
+      if (i->l == BUILTIN_Lread || i->l == BUILTIN_Lwrite || i->l == BUILTIN_Llength) {
+        depth -= pops;
+        push(c, s, &depth, true, -1);
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+  // Everything else pushes values of unknown type
+  depth -= pops;
+  for (int k = 0; k < pushes; k++) {
+    push(c, s, &depth, false, -1);
+  }
+}
+
+/* Merges the state into the one before the successor, returns true if the latter changed */
+static bool merge(const context *c, const state *from, state *to, bool *reached) {
+  if (!*reached) {
+    memcpy(to->ints, from->ints, c->words * sizeof(uint64_t));
+    memcpy(to->origin, from->origin, c->depth * sizeof(int));
+    *reached = true;
+    return true;
+  }
+  bool changed = false;
+  for (int w = 0; w < c->words; w++) {
+    const uint64_t ints = to->ints[w] & from->ints[w];
+    changed |= ints != to->ints[w];
+    to->ints[w] = ints;
+  }
+  for (int k = 0; k < c->depth; k++) {
+    if (to->origin[k] != from->origin[k] && to->origin[k] != -1) {
+      to->origin[k] = -1;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+static void infer_function(const program *p, const function *f, unsigned char *types, int *position) {
+  context c = {.p = p, .f = f, .vars = f->args_num + f->locals_num, .depth = f->max_depth + 1};
+  c.words = (c.vars + c.depth + 63) / 64;
+  state *in = checked_calloc(f->insns_num, sizeof(state));
+  bool *reached = checked_calloc(f->insns_num, sizeof(bool));
+  uint64_t *ints = checked_calloc((size_t) f->insns_num * c.words, sizeof(uint64_t));
+  int *origins = checked_calloc((size_t) f->insns_num * c.depth, sizeof(int));
+  for (int k = 0; k < f->insns_num; k++) {
+    position[f->insns[k]] = k;
+    in[k].ints = &ints[(size_t) k * c.words];
+    in[k].origin = &origins[(size_t) k * c.depth];
+  }
+  state out = {checked_calloc(c.words, sizeof(uint64_t)), checked_calloc(c.depth, sizeof(int))};
+  const int entry = position[p->index[f->begin]];
+  reached[entry] = true;
+  memset(in[entry].origin, -1, c.depth * sizeof(int));
+
+  // Forward dataflow to a fixed point, visiting instructions in code order
+  bool changed;
+  do {
+    changed = false;
+    for (int k = 0; k < f->insns_num; k++) {
+      if (!reached[k]) continue;
+      const int insn = f->insns[k];
+      memcpy(out.ints, in[k].ints, c.words * sizeof(uint64_t));
+      memcpy(out.origin, in[k].origin, c.depth * sizeof(int));
+      transfer(&c, &p->insns[insn], &out, p->depth[insn]);
+      int succ[2];
+      const int n = instruction_successors(p, insn, succ);
+      for (int s = 0; s < n; s++) {
+        const int j = position[succ[s]];
+        changed |= merge(&c, &out, &in[j], &reached[j]);
+      }
+    }
+  } while (changed);
+
+  for (int k = 0; k < f->insns_num; k++) {
+    const int insn = f->insns[k];
+    const int depth = p->depth[insn];
+    if (p->insns[insn].h != BINOP || !reached[k]) continue;
+    types[insn] = (is_int(&in[k], c.vars + depth - 2) ? TYPE_INT_LEFT : 0) |
+                  (is_int(&in[k], c.vars + depth - 1) ? TYPE_INT_RIGHT : 0);
+  }
+  free(out.origin);
+  free(out.ints);
+  free(origins);
+  free(ints);
+  free(reached);
+  free(in);
+}
+
+unsigned char *infer_types(const program *p) {
+  unsigned char *types = checked_calloc(p->insns_num, sizeof(unsigned char));
+  int *position = checked_calloc(p->insns_num, sizeof(int));
+  for (int f = 0; f < p->functions_num; f++) {
+    infer_function(p, &p->functions[f], types, position);
+  }
+  free(position);
+  return types;
+}
@@ -0,0 +1,19 @@
+//
+// Load-time type inference. A forward abstract interpretation of every
+// function tracks which arguments, locals and operand stack values are
+// proven to be unboxed integers, so that the register machine may use
+// arithmetic handlers without tag checks.
+//
+
+#ifndef HW2_TYPES_H
+#define HW2_TYPES_H
+
+#include "analysis.h"
+
+// Flags of a BINOP: its left or right operand is an unboxed integer on every path
+enum { TYPE_INT_LEFT = 1, TYPE_INT_RIGHT = 2, TYPE_INT_BOTH = 3 };
+
+/* Returns instruction index -> TYPE_INT_* flags of the BINOP operands, 0 for other instructions */
+unsigned char *infer_types(const program *p);
+
+#endif //HW2_TYPES_H